@@ -1,9 +1,49 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "boost/filesystem.hpp"
+
 #include "mass_edit.h"
 
+using namespace std;
+namespace fs = boost::filesystem;
+
+class CLIRenamer : public BaseRenamer {
+    public:
+        /* Constructor */
+        CLIRenamer();
+        /* CLI commands */
+        void InterpretCommands();
+        void InterpretChangeDir(stringstream & line);
+        void InterpretList(stringstream & line);
+        void InterpretShift(stringstream & line);
+        void InterpretInsert(stringstream & line);
+        void InterpretCompact(stringstream & line);
+        void InterpretSet(stringstream & line);
+        void InterpretRebucket(stringstream & line);
+        void InterpretManifest(stringstream & line);
+        void InterpretMaterialize(stringstream & line);
+        void InterpretMerge(stringstream & line);
+        void InterpretStats();
+        void InterpretExplain();
+        void InterpretQuit();
+        void InterpretHelp(string errmessage);
+        /* Print the planner's reasoning after each plan */
+        bool explain;
+    private:
+        unsigned long explained;
+};
+
 /********** CLIRenamer Class **********/
 /* Constructor */
 CLIRenamer::CLIRenamer()
-    : BaseRenamer()
+    : BaseRenamer(),
+      explain(false),
+      explained(0)
 {}
 
 /* CLI commands */
@@ -24,11 +64,28 @@ void CLIRenamer::InterpretCommands() {
                 InterpretShift(linestrm);
             } else if (first == "insert") {
                 InterpretInsert(linestrm);
+            } else if (first == "compact") {
+                InterpretCompact(linestrm);
+            } else if (first == "set") {
+                InterpretSet(linestrm);
+            } else if (first == "merge") {
+                InterpretMerge(linestrm);
+            } else if (first == "materialize") {
+                InterpretMaterialize(linestrm);
+            } else if (first == "apply-manifest") {
+                InterpretManifest(linestrm);
+            } else if (first == "rebucket") {
+                InterpretRebucket(linestrm);
+            } else if (first == "stats") {
+                InterpretStats();
             } else if (first == "quit") {
                 InterpretQuit();
             } else {
                 InterpretHelp("");
             }
+            if (explain) {
+                InterpretExplain();
+            }
         }
     }
 }
@@ -42,7 +99,7 @@ void CLIRenamer::InterpretChangeDir(stringstream & line) {
     } else {
         try {
             fs::current_path(dir);
-            listdir();
+            setDirectory(fs::current_path().string());
         } catch (fs::filesystem_error) {
             perror("Cannot change directory");
         }
@@ -52,9 +109,17 @@ void CLIRenamer::InterpretChangeDir(stringstream & line) {
 /* Do list directory */
 void CLIRenamer::InterpretList(stringstream & line) {
     vector<string> f = listdir();
-    f = filterfiles(regex("\\d+(\\.[a-zA-Z]{3})?"));
+    f = filterfiles(regex(DefaultScheme::filter()));
     for (size_t i = 0; i < f.size(); i++) {
-        cout << i << ". " << f[i] << endl;
+        cout << i << ". " << f[i];
+        vector<string> group(members(f[i]));
+        if (group.size() > 1 || group[0] != f[i]) {
+            for (size_t j = 0; j < group.size(); j++) {
+                cout << ((j == 0) ? " [" : " ") << group[j].substr(f[i].size());
+            }
+            cout << "]";
+        }
+        cout << endl;
     }
 }
 
@@ -66,32 +131,40 @@ void CLIRenamer::InterpretShift(stringstream & line) {
         InterpretHelp("shift command needs at least one argument");
         return;
     }
-    Range * r;
+    RangeSet r;
+    bool explicitRange(firstarg == "all" || Range::IsRange(firstarg)
+            || firstarg.find(',') != string::npos);
     if (firstarg == "all") {    // shift all files
-        r = new Range(0, files.size());
+        r = RangeSet(Range(0, files.size()));
+    } else if (firstarg.find(',') != string::npos) {    // read list of ranges
+        if (!RangeSet::IsRangeSet(firstarg)) {
+            InterpretHelp("incorrect shift usage");
+            return;
+        }
+        r = RangeSet(firstarg);
     } else if (Range::IsRange(firstarg)) {  // read range
-        r = new Range(firstarg);
+        r = RangeSet(Range(firstarg));
     } else {
         stringstream first(firstarg);   // Check if it's a number
         if (!(first >> amt)) {
             InterpretHelp("incorrect shift usage");
             return;
         }
-        r = new Range(0, files.size()); // If so, shift all
+        r = RangeSet(Range(0, files.size())); // If so, shift all
     }
     // Get amount to shift by
-    if ((firstarg == "all" || Range::IsRange(firstarg)) && !(line >> amt)) {
+    if (explicitRange && !(line >> amt)) {
         InterpretHelp("");
         return;
     }
     // perform error checking on the input
     Range filesIndex(0, files.size());
-    if (filesIndex.OutOfRange(*r)) {
+    if (r.OutOfRange(filesIndex)) {
         InterpretHelp("Files are out of range\n");
-    } else if (!check_shift(*r, amt)) {  // check for a conflict
+    } else if (!check_shift(r, amt)) {  // check for a conflict
         InterpretHelp("File collision illegal\n");
     } else {
-        shiftnames(*r, amt);
+        shiftnames(r, amt);
     }
 }
 
@@ -103,35 +176,215 @@ void CLIRenamer::InterpretInsert(stringstream & line) {
         InterpretHelp("insert command needs at least two arguments");
         return;
     }
-    Range * r;
-    if (Range::IsRange(first)) {    // first arg is range
-        r = new Range(first);
-    } else {                        // first arg is index
-        int index1;
-        stringstream firststr(first);
-        if (!(firststr >> index1)) {
-            InterpretHelp("incorrect insert usage");
-            return;
-        }
-        r = new Range(index1, index1 + 1);
+    if (!RangeSet::IsRangeSet(first)) { // first arg is a range, index or list
+        InterpretHelp("incorrect insert usage");
+        return;
     }
+    RangeSet r(first);
     if (!(line >> index2)) {        // second arg is index
         InterpretHelp("incorrect insert usage");
         return;
     }
     // error check, call function
     Range filesIndex(0, files.size());
-    if (filesIndex.OutOfRange(*r)) {
+    if (r.OutOfRange(filesIndex)) {
         InterpretHelp("Files out of range\n");
     } else if (filesIndex.OutOfRange(index2) && index2 != filesIndex.end()) {
         InterpretHelp("Insert point out of range\n");
-    } else if (!r->OutOfRange(index2)) {
+    } else if (r.Contains(index2)) {
         InterpretHelp("Cannot insert file into the same range\n");
     } else {
-        insert(*r, index2);
+        insert(r, index2);
+    }
+}
+
+/* Interpret the compact command. The range defaults to all files and start to
+ * the number of the first file in the range. */
+void CLIRenamer::InterpretCompact(stringstream & line) {
+    RangeSet r(Range(0, files.size()));
+    string firstarg;
+    int start, step(1);
+    bool haveStart(false);
+    if (line >> firstarg) {
+        if (firstarg == "all") {
+        } else if (Range::IsRange(firstarg) || firstarg.find(',') != string::npos) {
+            if (!RangeSet::IsRangeSet(firstarg)) {
+                InterpretHelp("incorrect compact usage");
+                return;
+            }
+            r = RangeSet(firstarg);
+        } else {
+            stringstream first(firstarg);
+            if (!(first >> start)) {
+                InterpretHelp("incorrect compact usage");
+                return;
+            }
+            haveStart = true;
+        }
+    }
+    if (!haveStart && (line >> start)) {
+        haveStart = true;
+    }
+    if (haveStart && !(line >> step) && !line.eof()) {
+        InterpretHelp("incorrect compact usage");
+        return;
+    }
+    Range filesIndex(0, files.size());
+    if (r.OutOfRange(filesIndex)) {
+        InterpretHelp("Files are out of range\n");
+        return;
+    } else if (step <= 0) {
+        InterpretHelp("Step must be positive\n");
+        return;
+    }
+    if (!compact(r, haveStart ? start : first_number(r), step)) {
+        InterpretHelp("File collision illegal\n");
+    }
+}
+
+/* Interpret the set command, which changes renamer options */
+void CLIRenamer::InterpretSet(stringstream & line) {
+    string option, value;
+    if (!(line >> option >> value)) {
+        InterpretHelp("set command needs an option and a value");
+        return;
+    }
+    if (option == "rate") {
+        stringstream valuestrm(value);
+        double rate;
+        if (!(valuestrm >> rate) || rate < 0) {
+            InterpretHelp("rate must be a number of renames per second, 0 for unlimited");
+            return;
+        }
+        pacing().setRate(rate);
+    } else if (option == "buckets") {
+        stringstream valuestrm(value);
+        int size;
+        if (!(valuestrm >> size) || size < 0) {
+            InterpretHelp("buckets must be a number of files per bucket, 0 for flat");
+            return;
+        }
+        setBuckets(size);
+    } else if (value != "on" && value != "off") {
+        InterpretHelp("set " + option + " needs on/off");
+    } else if (option == "staging") {
+        setStaging(value == "on");
+    } else if (option == "cache") {
+        setCache(value == "on");
+    } else if (option == "bundles") {
+        setBundles(value == "on");
+    } else if (option == "view") {
+        setView(value == "on");
+    } else if (option == "planner") {
+        setPlanner(value == "on");
+    } else if (option == "explain") {
+        explain = (value == "on");
+        if (explain) {
+            setPlanner(true);
+        }
+    } else {
+        InterpretHelp("unknown option " + option);
+    }
+}
+
+/* Interpret the rebucket command, which moves the files into a new layout */
+void CLIRenamer::InterpretRebucket(stringstream & line) {
+    int size;
+    if (!(line >> size) || size < 0) {
+        InterpretHelp("rebucket needs a number of files per bucket, 0 to flatten");
+        return;
+    }
+    try {
+        rebucket(size);
+    } catch (fs::filesystem_error & e) {
+        cerr << "Cannot rebucket: " << e.what() << endl;
     }
 }
 
+/* Interpret the apply-manifest command */
+void CLIRenamer::InterpretManifest(stringstream & line) {
+    string path;
+    if (!(line >> path)) {
+        InterpretHelp("apply-manifest needs a file of old<TAB>new lines");
+        return;
+    }
+    try {
+        apply_manifest(path);
+    } catch (fs::filesystem_error & e) {
+        cerr << "Cannot apply manifest: " << e.what() << endl;
+    }
+}
+
+/* Interpret the materialize command, linking the view into a directory */
+void CLIRenamer::InterpretMaterialize(stringstream & line) {
+    string target;
+    if (!(line >> target)) {
+        InterpretHelp("materialize needs a target directory");
+        return;
+    }
+    materialize(target);
+}
+
+/* Interpret the merge command. The mode defaults to append. */
+void CLIRenamer::InterpretMerge(stringstream & line) {
+    string other, mode("append");
+    int index(0);
+    if (!(line >> other)) {
+        InterpretHelp("merge needs the directory to merge in");
+        return;
+    }
+    line >> mode;
+    if (mode == "at" && (!(line >> index) || index < 0 || index > (int) files.size())) {
+        InterpretHelp("merge at needs an index from 0 to the number of files");
+        return;
+    } else if (mode != "append" && mode != "interleave" && mode != "at") {
+        InterpretHelp("merge mode must be append, interleave or at <index>");
+        return;
+    }
+    try {
+        merge(other, (mode == "append") ? MergeAppend
+                : (mode == "interleave") ? MergeInterleave : MergeAt, index);
+    } catch (fs::filesystem_error & e) {
+        cerr << "Cannot merge: " << e.what() << endl;
+    }
+}
+
+/* Show throughput and latency of the last rename plan */
+void CLIRenamer::InterpretStats() {
+    RenameThrottle::Stats s(pacing().stats());
+    cout << s.renames << " renames in " << fixed << setprecision(3) << s.seconds << "s ("
+        << setprecision(1) << s.throughput << "/s), p99 latency "
+        << setprecision(3) << s.p99 * 1000 << "ms";
+    if (pacing().getRate() > 0) {
+        cout << ", rate " << setprecision(1) << s.rate << "/s of " << pacing().getRate()
+            << "/s, " << s.backoffs << " backoffs";
+    }
+    cout << defaultfloat << endl;
+}
+
+/* Show the strategies the planner weighed for the last plan, once */
+void CLIRenamer::InterpretExplain() {
+    const StrategyChoice & c(last_strategy());
+    if (c.plan == explained) {
+        return;
+    }
+    explained = c.plan;
+    cout << "plan: " << c.shape.moves << " moves in " << c.shape.chains << " chains ("
+        << c.shape.cycles << " cycles), " << c.shape.entries << " entries, on "
+        << c.filesystem << endl;
+    for (int s = 0; s < StrategyCount; s++) {
+        cout << "  " << left << setw(14) << CostModel::name((RenameStrategy) s);
+        if (c.estimates[s] < 0) {
+            cout << "not possible";
+        } else {
+            cout << fixed << setprecision(3) << c.estimates[s] * 1000 << "ms";
+        }
+        cout << ((s == c.chosen) ? "  <- chosen" : "") << endl;
+    }
+    cout << (c.failed ? "failed after " : "took ") << fixed << setprecision(3) << c.seconds * 1000
+        << "ms" << defaultfloat << endl;
+}
+
 /* Quit */
 void CLIRenamer::InterpretQuit() {
     exit(0);
@@ -143,16 +396,40 @@ void CLIRenamer::InterpretHelp(string errmessage) {
         cerr << errmessage << endl;
     }
     cout << "Usage:" << endl;
-    cout << left << setw(30) << "cd <directory>" << setw(40) << "change directory" << endl;
-    cout << left << setw(30) << "ls" << setw(40) << "list directory contents with indices" << endl;
-    cout << left << setw(30) << "shift <all|range> <amount>" << setw(40) << "shift file numbers by some amount. shift <amt> defaults to all" << endl;
-    cout << left << setw(30) << "insert <range|index> <index>" << setw(40) << "switch items 1 and 2, appropriately shifting the other items" << endl;
+    cout << left << setw(32) << "cd <directory>" << setw(40) << "change directory" << endl;
+    cout << left << setw(32) << "ls" << setw(40) << "list directory contents with indices" << endl;
+    cout << left << setw(32) << "shift <all|ranges> <amount>" << setw(40) << "shift file numbers by some amount. shift <amt> defaults to all" << endl;
+    cout << left << setw(32) << "insert <ranges|index> <index>" << setw(40) << "switch items 1 and 2, appropriately shifting the other items" << endl;
+    cout << left << setw(32) << "compact [ranges] [start] [step]" << setw(40) << "renumber files densely, closing gaps" << endl;
+    cout << left << setw(32) << "" << setw(40) << "ranges can be comma separated, e.g. 0-2,5,8-10" << endl;
+    cout << left << setw(32) << "set staging <on|off>" << setw(40) << "build changes in a staging directory and swap it in atomically" << endl;
+    cout << left << setw(32) << "set cache <on|off>" << setw(40) << "reuse listings of unchanged directories from the on-disk cache" << endl;
+    cout << left << setw(32) << "set rate <renames/s>" << setw(40) << "pace renames, backing off when latency rises. 0 is unlimited" << endl;
+    cout << left << setw(32) << "set bundles <on|off>" << setw(40) << "list and rename same-number files (03.txt, 03.pdf) as one entry" << endl;
+    cout << left << setw(32) << "set buckets <size>" << setw(40) << "treat the directory as split into numbered subdirectories of size files" << endl;
+    cout << left << setw(32) << "merge <dir> [mode]" << setw(40) << "move dir's numbered files in, renumbering densely. mode: append, interleave or at <index>" << endl;
+    cout << left << setw(32) << "set view <on|off>" << setw(40) << "make the commands rename a view of the directory, leaving the files alone" << endl;
+    cout << left << setw(32) << "materialize <dir>" << setw(40) << "link the view's names into dir, relinking only what changed" << endl;
+    cout << left << setw(32) << "apply-manifest <file>" << setw(40) << "rename by a file of old<TAB>new lines, checked before anything moves" << endl;
+    cout << left << setw(32) << "rebucket <size>" << setw(40) << "move the files into subdirectories of size files. 0 flattens" << endl;
+    cout << left << setw(32) << "set planner <on|off>" << setw(40) << "pick the cheapest way to run each change from a calibrated cost model" << endl;
+    cout << left << setw(32) << "set explain <on|off>" << setw(40) << "show the planner's estimates and choice after each change" << endl;
+    cout << left << setw(32) << "stats" << setw(40) << "show throughput and p99 latency of the last operation" << endl;
     cout << "quit" << endl;
 }
 
 /* Main program; creates an instance of CLIRenamer, and starts REPL loop */
-int main() {
+int main(int argc, char **argv) {
     CLIRenamer cli;
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--explain") {
+            cli.explain = true;
+            cli.setPlanner(true);
+        } else {
+            cerr << "Usage: " << argv[0] << " [--explain]" << endl;
+            return 1;
+        }
+    }
     cli.InterpretCommands();
 
     return 0;
@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <thread>
+#include <vector>
+#include "boost/filesystem.hpp"
+
+#include "cost_model.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+/* Calibration renames this many files; each run moves a correction factor
+ * this far towards actual/estimated, and never beyond the bounds. */
+static const size_t calibrationFiles = 200;
+static const double learningRate = 0.2;
+static const double minCorrection = 0.1;
+static const double maxCorrection = 10;
+
+/* Names of the common statfs f_type magic numbers */
+static string filesystemName(long type) {
+    switch (type) {
+        case 0xEF53: return "ext2/3/4";
+        case 0x58465342: return "xfs";
+        case 0x9123683E: return "btrfs";
+        case 0x01021994: return "tmpfs";
+        case 0x6969: return "nfs";
+        case 0x794C7630: return "overlayfs";
+        case 0x2FC12FC1: return "zfs";
+    }
+    stringstream hex;
+    hex << "0x" << std::hex << type;
+    return hex.str();
+}
+
+/********** CostModel class **********/
+/* Constructor, keeping measurements in cachedir */
+CostModel::CostModel(const string & cachedir)
+    : location(cachedir),
+      loaded(false),
+      fsType(0),
+      renameCost(0),
+      linkCost(0),
+      unlinkCost(0),
+      parallelSpeedup(1)
+{
+    fill(correction, correction + StrategyCount, 1.0);
+}
+
+const char * CostModel::name(RenameStrategy strategy) {
+    static const char * names[StrategyCount] = {"direct", "staging", "parallel"};
+    return names[strategy];
+}
+
+const string & CostModel::filesystem() const { return fsName; }
+
+/* Load the costs for the filesystem dir is on, measuring them the first
+ * time that filesystem type is seen */
+bool CostModel::prepare(const string & dir) {
+    struct statfs st;
+    if (statfs(dir.c_str(), &st) != 0) {
+        perror("Cannot identify filesystem");
+        return false;
+    }
+    if (loaded && fsType == (long) st.f_type) {
+        return true;
+    }
+    fsType = st.f_type;
+    fsName = filesystemName(fsType);
+    ifstream in(path());
+    loaded = static_cast<bool>(in >> renameCost >> linkCost >> unlinkCost >> parallelSpeedup);
+    for (size_t i = 0; loaded && i < StrategyCount; i++) {
+        loaded = static_cast<bool>(in >> correction[i]);
+    }
+    // a file written for another set of strategies is measured again
+    string extra;
+    loaded = loaded && !(in >> extra);
+    if (!loaded) {
+        fill(correction, correction + StrategyCount, 1.0);
+        loaded = calibrate(dir);
+        if (loaded) {
+            store();
+        }
+    }
+    return loaded;
+}
+
+/* Estimated seconds for a strategy on a plan of this shape */
+double CostModel::estimate(RenameStrategy strategy, const PlanShape & shape) const {
+    return raw(strategy, shape) * correction[strategy];
+}
+
+/* Direct renames pay one rename per move plus one per cycle. Staging links
+ * and later unlinks every entry, plus the swap.
+ * Parallel chains divide the direct cost by the measured speedup, as far as
+ * there are chains to share out. */
+double CostModel::raw(RenameStrategy strategy, const PlanShape & shape) const {
+    switch (strategy) {
+        case DirectRenames:
+            return (shape.moves + shape.cycles) * renameCost;
+        case StagingSwap:
+            return shape.entries * (linkCost + unlinkCost) + renameCost;
+        case ParallelChains:
+            return (shape.moves + shape.cycles) * renameCost
+                / max(1.0, min(parallelSpeedup, (double) shape.chains));
+        default:
+            return 0;
+    }
+}
+
+/* Fold in how long a strategy took, and store the costs */
+void CostModel::learn(RenameStrategy strategy, const PlanShape & shape, double seconds) {
+    double estimated(raw(strategy, shape));
+    if (!loaded || estimated <= 0) {
+        return;
+    }
+    double & factor(correction[strategy]);
+    factor += learningRate * (seconds / estimated - factor);
+    factor = min(maxCorrection, max(minCorrection, factor));
+    store();
+}
+
+/* Time renames, hardlinks and unlinks of empty files in a scratch
+ * directory next to dir, so they hit the same filesystem without touching
+ * dir itself, then renames spread over several threads */
+bool CostModel::calibrate(const string & dir) {
+    fs::path parent(fs::absolute(dir).parent_path());
+    fs::path scratch(parent / fs::unique_path(".mass_edit_calibrate-%%%%-%%%%"));
+    struct stat dirStat, parentStat;
+    if (stat(dir.c_str(), &dirStat) != 0 || stat(parent.c_str(), &parentStat) != 0
+            || dirStat.st_dev != parentStat.st_dev) {
+        cerr << "Cannot measure rename costs: " << parent.string()
+             << " is not on the same filesystem as " << dir << endl;
+        return false;
+    }
+    typedef chrono::steady_clock clock;
+    try {
+        fs::create_directory(scratch);
+        fs::create_directory(scratch / "links");
+        for (size_t i = 0; i < calibrationFiles; i++) {
+            ofstream((scratch / ("a" + to_string(i))).string());
+        }
+        clock::time_point start(clock::now());
+        for (size_t i = 0; i < calibrationFiles; i++) {
+            fs::rename(scratch / ("a" + to_string(i)), scratch / ("b" + to_string(i)));
+        }
+        renameCost = chrono::duration<double>(clock::now() - start).count() / calibrationFiles;
+        start = clock::now();
+        for (size_t i = 0; i < calibrationFiles; i++) {
+            fs::create_hard_link(scratch / ("b" + to_string(i)), scratch / "links" / to_string(i));
+        }
+        linkCost = chrono::duration<double>(clock::now() - start).count() / calibrationFiles;
+        start = clock::now();
+        for (size_t i = 0; i < calibrationFiles; i++) {
+            fs::remove(scratch / "links" / to_string(i));
+        }
+        unlinkCost = chrono::duration<double>(clock::now() - start).count() / calibrationFiles;
+
+        size_t threads(max(1u, min(8u, thread::hardware_concurrency())));
+        vector<thread> workers;
+        start = clock::now();
+        for (size_t t = 0; t < threads; t++) {
+            workers.push_back(thread([&scratch, t, threads]() {
+                for (size_t i = t; i < calibrationFiles; i += threads) {
+                    boost::system::error_code ec;
+                    fs::rename(scratch / ("b" + to_string(i)), scratch / ("a" + to_string(i)), ec);
+                }
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+        double parallel(chrono::duration<double>(clock::now() - start).count());
+        parallelSpeedup = max(1.0, renameCost * calibrationFiles / max(parallel, 1e-9));
+        fs::remove_all(scratch);
+    } catch (fs::filesystem_error & e) {
+        cerr << "Cannot measure rename costs: " << e.what() << endl;
+        boost::system::error_code ec;
+        fs::remove_all(scratch, ec);
+        return false;
+    }
+    return true;
+}
+
+/* One file per filesystem type, named by its f_type in hex */
+string CostModel::path() const {
+    stringstream name;
+    name << std::hex << fsType;
+    return (fs::path(location) / name.str()).string();
+}
+
+/* Unit costs, speedup and corrections on one line */
+void CostModel::store() const {
+    boost::system::error_code ec;
+    fs::create_directories(location, ec);
+    ofstream out(path());
+    out.precision(9);
+    out << renameCost << " " << linkCost << " " << unlinkCost << " " << parallelSpeedup;
+    for (size_t i = 0; i < StrategyCount; i++) {
+        out << " " << correction[i];
+    }
+    out << endl;
+}
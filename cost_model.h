@@ -0,0 +1,72 @@
+#ifndef COST_MODEL_H
+#define COST_MODEL_H
+
+#include <cstddef>
+#include <string>
+
+/* Ways execute_plan can carry out a rename plan */
+enum RenameStrategy {
+    DirectRenames,      // chains in place, a temporary name per cycle
+    StagingSwap,        // hardlink into a staging directory and swap it in
+    ParallelChains,     // independent chains on several threads
+    StrategyCount
+};
+
+/* What a plan's cost depends on */
+struct PlanShape {
+    size_t moves;       // files changing name
+    size_t chains;      // independent sequences of renames, cycles included
+    size_t cycles;      // sequences that need a temporary name
+    size_t entries;     // entries in the directory, all linked when staging
+};
+
+/* The strategy picked for the last plan, and why */
+struct StrategyChoice {
+    unsigned long plan;     // number of plans planned so far, 0 for none
+    PlanShape shape;
+    std::string filesystem;
+    double estimates[StrategyCount];    // seconds, negative if not possible
+    RenameStrategy chosen;
+    double seconds;         // how long the chosen strategy took
+    bool failed;            // if it stopped partway; not learned from
+};
+
+/* Cost model for the strategies, per filesystem type (statfs f_type). The
+ * unit costs of a rename, a hardlink and an unlink, and how much renames
+ * speed up on several threads, are measured once in a scratch directory and
+ * kept in the cache directory. Each strategy also has a correction factor,
+ * moved towards actual/estimated every time it runs, so the estimates track
+ * what the filesystem really does. */
+class CostModel {
+    public:
+        /* Constructor, keeping measurements in cachedir */
+        CostModel(const std::string & cachedir);
+        static const char * name(RenameStrategy strategy);
+        /* Load the costs for the filesystem dir is on, measuring them in a
+         * scratch directory next to dir if there are none yet. Returns false
+         * if they can't be measured. */
+        bool prepare(const std::string & dir);
+        /* Name of the filesystem type prepared for */
+        const std::string & filesystem() const;
+        /* Estimated seconds for a strategy on a plan of this shape */
+        double estimate(RenameStrategy strategy, const PlanShape & shape) const;
+        /* Fold in how long a strategy took, and store the costs */
+        void learn(RenameStrategy strategy, const PlanShape & shape, double seconds);
+    private:
+        std::string location;
+        bool loaded;
+        long fsType;
+        std::string fsName;
+        double renameCost;
+        double linkCost;
+        double unlinkCost;
+        double parallelSpeedup;
+        double correction[StrategyCount];
+        /* Estimate before the correction factor */
+        double raw(RenameStrategy strategy, const PlanShape & shape) const;
+        bool calibrate(const std::string & dir);
+        std::string path() const;
+        void store() const;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#include <utility>
+
+#include "directory_model.h"
+
+using namespace std;
+
+/********** NameList class **********/
+/* Constructors */
+NameList::NameList()
+    : data(make_shared<const vector<string>>())
+{}
+
+NameList::NameList(vector<string> names)
+    : data(make_shared<const vector<string>>(move(names)))
+{}
+
+/********** DirectoryRegistry class **********/
+DirectoryRegistry & DirectoryRegistry::instance() {
+    static DirectoryRegistry registry;
+    return registry;
+}
+
+/* Current snapshot of the directory, or null if there is none or the
+ * directory changed on disk since it was taken. As with the listing cache, a
+ * snapshot whose key was within the racy window of its scan isn't trusted,
+ * since a change in the same timestamp tick would leave the key matching. */
+shared_ptr<const DirectorySnapshot> DirectoryRegistry::current(const string & dir,
+        const string & scheme) {
+    shared_ptr<const DirectorySnapshot> snapshot;
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, Entry>::iterator it = entries.find(scheme + ":" + dir);
+        if (it != entries.end()) {
+            snapshot = it->second.snapshot.lock();
+        }
+    }
+    if (snapshot && !ListingCache::settled(dir, snapshot->key, snapshot->scanned)) {
+        snapshot.reset();
+    }
+    return snapshot;
+}
+
+/* Publish a new snapshot and tell the other subscribers about it. Listeners
+ * are called on the publisher's thread, after the registry is unlocked. */
+shared_ptr<const DirectorySnapshot> DirectoryRegistry::publish(const string & dir,
+        const string & scheme, const DirectoryKey & key, time_t scanned,
+        NameList files, size_t longestName, bool needNormalize,
+        const void * publisher) {
+    vector<Listener> notify;
+    shared_ptr<DirectorySnapshot> snapshot(make_shared<DirectorySnapshot>());
+    snapshot->key = key;
+    snapshot->scanned = scanned;
+    snapshot->files = files;
+    snapshot->longestName = longestName;
+    snapshot->needNormalize = needNormalize;
+    {
+        lock_guard<mutex> guard(lock);
+        Entry & entry = entries[scheme + ":" + dir];
+        snapshot->version = ++entry.version;
+        entry.snapshot = snapshot;
+        for (map<const void *, Listener>::iterator it = entry.listeners.begin();
+                it != entry.listeners.end(); it++) {
+            if (it->first != publisher) {
+                notify.push_back(it->second);
+            }
+        }
+    }
+    for (size_t i = 0; i < notify.size(); i++) {
+        notify[i](snapshot->version);
+    }
+    return snapshot;
+}
+
+/* Call listener when someone else publishes a version of dir */
+void DirectoryRegistry::subscribe(const string & dir, const string & scheme,
+        const void * owner, Listener listener) {
+    unsubscribe(owner);
+    lock_guard<mutex> guard(lock);
+    entries[scheme + ":" + dir].listeners[owner] = listener;
+}
+
+/* Drop the owner's subscription, and any entries nobody uses any more */
+void DirectoryRegistry::unsubscribe(const void * owner) {
+    lock_guard<mutex> guard(lock);
+    map<string, Entry>::iterator it = entries.begin();
+    while (it != entries.end()) {
+        it->second.listeners.erase(owner);
+        if (it->second.listeners.empty() && it->second.snapshot.expired()) {
+            it = entries.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef DIRECTORY_MODEL_H
+#define DIRECTORY_MODEL_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "listing_cache.h"
+
+/* A copy-on-write list of names. Copies share the same vector; anything that
+ * would change the names builds a new vector instead. */
+class NameList {
+    public:
+        NameList();
+        NameList(std::vector<std::string> names);
+        size_t size() const { return data->size(); }
+        bool empty() const { return data->empty(); }
+        const std::string & operator[](size_t i) const { return (*data)[i]; }
+        std::vector<std::string>::const_iterator begin() const { return data->begin(); }
+        std::vector<std::string>::const_iterator end() const { return data->end(); }
+        const std::vector<std::string> & names() const { return *data; }
+    private:
+        std::shared_ptr<const std::vector<std::string>> data;
+};
+
+/* One published version of a directory's sorted listing */
+struct DirectorySnapshot {
+    DirectoryKey key;
+    time_t scanned;     // when the scan it came from started
+    NameList files;
+    size_t longestName;
+    bool needNormalize;
+    unsigned long version;
+};
+
+/* Process-wide registry of directory listings, so renamers working on the
+ * same directory (e.g. several GUI sessions) share one scan and one copy of
+ * the names. A renamer that changes the directory rescans it and publishes a
+ * new version; the other renamers subscribed to the directory are then
+ * called so they can rebase onto it. Snapshots are only held weakly: once no
+ * renamer uses a version it is freed. */
+class DirectoryRegistry {
+    public:
+        typedef std::function<void(unsigned long version)> Listener;
+        static DirectoryRegistry & instance();
+        /* Current snapshot of the directory as sorted by scheme, or null if
+         * there is none, the directory changed on disk since it was taken, or
+         * it is too recent to tell (see ListingCache::settled) */
+        std::shared_ptr<const DirectorySnapshot> current(const std::string & dir,
+                const std::string & scheme);
+        /* Publish a new snapshot and tell the other subscribers about it */
+        std::shared_ptr<const DirectorySnapshot> publish(const std::string & dir,
+                const std::string & scheme, const DirectoryKey & key, time_t scanned,
+                NameList files, size_t longestName, bool needNormalize,
+                const void * publisher);
+        /* Call listener when someone else publishes a version of dir. One
+         * subscription per owner; subscribing again replaces it. */
+        void subscribe(const std::string & dir, const std::string & scheme,
+                const void * owner, Listener listener);
+        void unsubscribe(const void * owner);
+    private:
+        struct Entry {
+            Entry() : version(0) {}
+            std::weak_ptr<const DirectorySnapshot> snapshot;
+            unsigned long version;
+            std::map<const void *, Listener> listeners;
+        };
+        std::mutex lock;
+        std::map<std::string, Entry> entries;
+};
+
+#endif
@@ -0,0 +1,230 @@
+#include <Wt/Test/WTestEnvironment>
+#include <Wt/WContainerWidget>
+#include <Wt/WIntValidator>
+#include <Wt/WLineEdit>
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "gui_mass_edit.h"
+
+using namespace std;
+using namespace Wt;
+namespace fs = boost::filesystem;
+
+/*
+ * Headless load test for the GUI. Starts M sessions at once, each a
+ * RenameApplication in a Wt test environment on its own thread, working on
+ * its own generated directory of N files. Every session runs the same script
+ * of handlers a number of times, and the bench reports, per handler, the
+ * latency percentiles, the widgets on the page and the size of the HTML the
+ * page amounts to afterwards (what a full update would send), along with the
+ * memory each session holds.
+ *
+ *     gui_bench [sessions] [files] [rounds]
+ */
+class GuiBench {
+    public:
+        GuiBench(size_t sessions, size_t files, size_t rounds);
+        ~GuiBench();
+        void run();
+        void report();
+    private:
+        struct Sample {
+            double seconds;
+            size_t widgets;
+            size_t payload;
+        };
+        size_t sessions, files, rounds;
+        fs::path workdir;
+        mutex lock;
+        condition_variable cv;
+        size_t ready;
+        bool go;
+        long residentBefore, residentLoaded;
+        map<string, vector<Sample>> samples;
+        void generate(const fs::path & dir);
+        void session(size_t index);
+        void timed(RenameApplication & app, const string & handler,
+                function<void()> call, vector<pair<string, Sample>> & out);
+        static size_t count_widgets(WWidget * widget);
+        static long resident_bytes();
+};
+
+/* Generates the session directories, named like genfiles' output */
+GuiBench::GuiBench(size_t sessions, size_t files, size_t rounds)
+    : sessions(sessions),
+      files(files),
+      rounds(rounds),
+      workdir(fs::temp_directory_path() / fs::unique_path("mass_edit_bench-%%%%-%%%%")),
+      ready(0),
+      go(false),
+      residentBefore(0),
+      residentLoaded(0)
+{
+    fs::create_directory(workdir);
+    for (size_t i = 0; i < sessions; i++) {
+        generate(workdir / to_string(i));
+    }
+}
+
+GuiBench::~GuiBench() {
+    boost::system::error_code ec;
+    fs::remove_all(workdir, ec);
+}
+
+void GuiBench::generate(const fs::path & dir) {
+    fs::create_directory(dir);
+    size_t width(to_string(files).size());
+    for (size_t i = 0; i < files; i++) {
+        stringstream name;
+        name << setfill('0') << setw(width) << i << ".txt";
+        ofstream((dir / name.str()).string()) << i << endl;
+    }
+}
+
+/* Start every session, measure memory once they have all loaded their
+ * directory, then let them run the script together */
+void GuiBench::run() {
+    residentBefore = resident_bytes();
+    vector<thread> workers;
+    for (size_t i = 0; i < sessions; i++) {
+        workers.push_back(thread(&GuiBench::session, this, i));
+    }
+    {
+        unique_lock<mutex> guard(lock);
+        cv.wait(guard, [this]() { return ready == sessions; });
+        residentLoaded = resident_bytes();
+        go = true;
+    }
+    cv.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+/* One session: load the directory, then per round select the upper half
+ * and shift it out and back, insert the first files in the middle, and
+ * parse */
+void GuiBench::session(size_t index) {
+    Test::WTestEnvironment env;
+    RenameApplication app(env);
+    WIntValidator validator(0, files);
+    vector<pair<string, Sample>> out;
+    app.directory->setText((workdir / to_string(index)).string());
+    timed(app, "retrieve_files", [&]() { app.retrieve_files(); }, out);
+    {
+        unique_lock<mutex> guard(lock);
+        ready++;
+        cv.notify_all();
+        cv.wait(guard, [this]() { return go; });
+    }
+    for (size_t round = 0; round < rounds; round++) {
+        timed(app, "set_range", [&]() { app.set_range(files / 2); }, out);
+        timed(app, "set_range", [&]() { app.set_range(files - 1); }, out);
+        app.shift_input->setText((round % 2 == 0) ? "1" : "-1");
+        timed(app, "shift_gui", [&]() { app.shift_gui(app.shift_input); }, out);
+        app.set_range(0);
+        app.set_range(min<size_t>(2, files - 1));
+        app.insert_input->setText(to_string(files / 2));
+        timed(app, "insert_gui", [&]() { app.insert_gui(app.insert_input, &validator); }, out);
+        timed(app, "parse", [&]() { app.parse(); }, out);
+        timed(app, "retrieve_files", [&]() { app.retrieve_files(); }, out);
+    }
+    lock_guard<mutex> guard(lock);
+    for (size_t i = 0; i < out.size(); i++) {
+        samples[out[i].first].push_back(out[i].second);
+    }
+}
+
+/* Run a handler, recording its latency and the page it leaves behind */
+void GuiBench::timed(RenameApplication & app, const string & handler,
+        function<void()> call, vector<pair<string, Sample>> & out) {
+    chrono::steady_clock::time_point start(chrono::steady_clock::now());
+    call();
+    Sample s;
+    s.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    s.widgets = count_widgets(app.root());
+    stringstream html;
+    app.root()->htmlText(html);
+    s.payload = html.str().size();
+    out.push_back(make_pair(handler, s));
+}
+
+/* Widgets in the tree under widget, itself included */
+size_t GuiBench::count_widgets(WWidget * widget) {
+    WContainerWidget * container = dynamic_cast<WContainerWidget *>(widget);
+    size_t count(1);
+    for (int i = 0; container && i < container->count(); i++) {
+        count += count_widgets(container->widget(i));
+    }
+    return count;
+}
+
+/* Resident set size of the process, from /proc/self/statm */
+long GuiBench::resident_bytes() {
+    long pages(0), resident(0);
+    ifstream statm("/proc/self/statm");
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static double percentile(vector<double> & values, double p) {
+    size_t index((values.size() - 1) * p);
+    nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+void GuiBench::report() {
+    cout << sessions << " sessions, " << files << " files, " << rounds << " rounds" << endl;
+    cout << "memory per session: "
+         << (residentLoaded - residentBefore) / (long) max<size_t>(1, sessions) / 1024 << " KiB" << endl;
+    cout << left << setw(16) << "handler" << right << setw(8) << "calls"
+         << setw(12) << "p50 ms" << setw(12) << "p90 ms" << setw(12) << "p99 ms"
+         << setw(12) << "max ms" << setw(10) << "widgets" << setw(12) << "html KiB" << endl;
+    for (map<string, vector<Sample>>::iterator it = samples.begin(); it != samples.end(); it++) {
+        vector<double> latencies;
+        size_t widgets(0), payload(0);
+        for (size_t i = 0; i < it->second.size(); i++) {
+            latencies.push_back(it->second[i].seconds * 1000);
+            widgets = max(widgets, it->second[i].widgets);
+            payload = max(payload, it->second[i].payload);
+        }
+        cout << left << setw(16) << it->first << right << setw(8) << latencies.size()
+             << fixed << setprecision(2)
+             << setw(12) << percentile(latencies, 0.5)
+             << setw(12) << percentile(latencies, 0.9)
+             << setw(12) << percentile(latencies, 0.99)
+             << setw(12) << *max_element(latencies.begin(), latencies.end())
+             << setw(10) << widgets << setw(12) << payload / 1024 << endl;
+    }
+}
+
+/* Main method for the bench */
+int main(int argc, char **argv) {
+    size_t sessions((argc > 1) ? atoi(argv[1]) : 8);
+    size_t files((argc > 2) ? atoi(argv[2]) : 1000);
+    size_t rounds((argc > 3) ? atoi(argv[3]) : 5);
+    if (sessions == 0 || files < 4) {
+        cerr << "Usage: gui_bench [sessions] [files (at least 4)] [rounds]" << endl;
+        return 1;
+    }
+    GuiBench bench(sessions, files, rounds);
+    bench.run();
+    bench.report();
+    return 0;
+}
@@ -1,65 +1,41 @@
 #include <Wt/WApplication>
 #include <Wt/WBreak>
+#include <Wt/WCheckBox>
 #include <Wt/WContainerWidget>
 #include <Wt/WCssStyleSheet>
 #include <Wt/WIntValidator>
 #include <Wt/WLineEdit>
 #include <Wt/WPushButton>
+#include <Wt/WServer>
 #include <Wt/WText>
 
 #include <boost/algorithm/string/join.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
 #include <sstream>
 #include <string>
+#include <vector>
 
-#include "mass_edit.h"
+#include "gui_mass_edit.h"
 
 #define FIRST_UNSELECTED -1
 #define SELECTED -2
 
+using namespace std;
 using namespace Wt;
-
-/*
- * GUI interface for the rename application, allowing users to mass edit
- * numbered files with ease.
- */
-class RenameApplication : public WApplication, public BaseRenamer {
-    public:
-        RenameApplication(const WEnvironment& env);
-        WContainerWidget * response;
-        WContainerWidget * tableContainer;
-        WContainerWidget * controls;
-
-    private:
-        WLineEdit * directory;
-        WLineEdit * shift_input;
-        WLineEdit * insert_input;
-        vector<WPushButton *> fileContainers;
-        int first_index;
-        Range range;
-        bool a_pressed, ctrl_pressed;
-        void retrieve_files();
-        void display_files();
-        void normalizeOp();
-        void parse();
-        void increment(int i, bool isPlus);
-        void set_range(int index);
-        void select_all(WKeyEvent w);
-        void key_up(WKeyEvent w);
-        void add_controls();
-        void select_control(WContainerWidget * selected, WContainerWidget * disabled);
-        void shift_gui(WLineEdit * input);
-        void insert_gui(WLineEdit * input, WIntValidator * intv);
-        void alert(string message);
-};
+namespace fs = boost::filesystem;
 
 /* Constructor for RenameApplication. */
 RenameApplication::RenameApplication(const WEnvironment& env)
     : WApplication(env),
-      BaseRenamer(),
-      range(0, 0) {
+      BaseRenamer() {
 
     first_index = FIRST_UNSELECTED;
     a_pressed = false, ctrl_pressed = false;
+    // Sessions on the same directory share one listing, and are pushed the
+    // new one when another session changes the directory
+    setShared(true);
+    enableUpdates(true);
     WApplication::instance()->useStyleSheet("style.css");
     WApplication::instance()->declareJavaScriptFunction("addHover", "function() { var styleSheet = document.styleSheets[1]['cssRules'][2]['styleSheet']; for (i = 0; i < styleSheet['cssRules'].length; i++) { if (styleSheet['cssRules'][i]['selectorText'] === '.files:hover') { return; } } styleSheet.insertRule('.files:hover { background-color: var(--hover-color); }', 0);}");
     WApplication::instance()->declareJavaScriptFunction("deleteHover", "function() {var styleSheet = document.styleSheets[1]['cssRules'][2]['styleSheet']; for (i = 0; i < styleSheet['cssRules'].length; i++) {if (styleSheet['cssRules'][i]['selectorText'] === '.files:hover') {styleSheet.deleteRule(i); break;}}}");
@@ -71,6 +47,15 @@ RenameApplication::RenameApplication(const WEnvironment& env)
     directory = new WLineEdit(root());
     directory->setFocus();
     WPushButton * button = new WPushButton("Get files", root());
+    WCheckBox * staging = new WCheckBox("Publish changes atomically", root());
+    staging->changed().connect(std::bind(&RenameApplication::staging_changed,
+                this, staging));
+    WCheckBox * caching = new WCheckBox("Cache listings", root());
+    caching->changed().connect(std::bind(&RenameApplication::cache_changed,
+                this, caching));
+    WCheckBox * bundling = new WCheckBox("Group files by number", root());
+    bundling->changed().connect(std::bind(&RenameApplication::bundles_changed,
+                this, bundling));
 
     root()->addWidget(new WBreak());
     root()->addWidget(new WBreak());
@@ -93,19 +78,26 @@ void RenameApplication::retrieve_files() {
     tableContainer->clear();
     controls->clear();
     first_index = FIRST_UNSELECTED;
+    selection = RangeSet();
     WApplication::instance()->doJavaScript(WApplication::instance()->javaScriptClass() + ".addHover()");
     WApplication::instance()->doJavaScript("document.body.style.setProperty(\"--hover-color\", \"yellow\")");
     std::string filename(directory->text().toUTF8());
     response->addWidget(new WText("Checking directory " + filename));
 
     try {
-        fs::current_path(filename);
-        listdir();
+        // not fs::current_path: the working directory is shared by every
+        // session in the process
+        setDirectory(filename);
     } catch (fs::filesystem_error) {
         tableContainer->addWidget(new WText("Error: Cannot access directory " + filename));
         return;
     }
 
+    string session(sessionId());
+    subscribe([this, session]() {
+        WServer::instance()->post(session, std::bind(&RenameApplication::rebase, this));
+    });
+
     display_files();
     tableContainer->addWidget(new WBreak());
     WPushButton * reset = new WPushButton("Reset", tableContainer);
@@ -119,17 +111,43 @@ void RenameApplication::retrieve_files() {
     tableContainer->keyWentUp().connect(this, &RenameApplication::key_up);
 }
 
+/* Picks up the version of the directory another session published. The
+ * selection is dropped, since the indices it refers to may have moved. */
+void RenameApplication::rebase() {
+    tableContainer->clear();
+    controls->clear();
+    first_index = FIRST_UNSELECTED;
+    selection = RangeSet();
+    listdir();
+    response->clear();
+    response->addWidget(new WText("Directory " + BaseRenamer::directory() + " was changed by another session"));
+
+    display_files();
+    tableContainer->addWidget(new WBreak());
+    WPushButton * reset = new WPushButton("Reset", tableContainer);
+    reset->clicked().connect(this, &RenameApplication::retrieve_files);
+    triggerUpdate();
+}
+
 /* Displays files on the page */
 void RenameApplication::display_files() {
     fileContainers = vector<WPushButton *>(0);
     bool incFound(false);
     for (size_t i = 0; i < files.size(); i++) {
         string file(files[i]);
-        if (file.find("+.") != string::npos
-                || file.find("-.") != string::npos) {
+        if (DefaultScheme::isNumbered(file) && !DefaultScheme::flags(file).empty()) {
             incFound = true;
         }
-        WPushButton * fileButton = new WPushButton(file);
+        // a bundle's label lists the extensions it holds, e.g. "03 [.pdf .txt]"
+        string label(file);
+        vector<string> group(members(file));
+        if (group.size() > 1 || group[0] != file) {
+            for (size_t j = 0; j < group.size(); j++) {
+                label += ((j == 0) ? " [" : " ") + group[j].substr(file.size());
+            }
+            label += "]";
+        }
+        WPushButton * fileButton = new WPushButton(label);
         WContainerWidget * fileDiv = new WContainerWidget(tableContainer);
         fileDiv->setStyleClass("filesdiv");
         fileButton->setStyleClass("files");
@@ -179,24 +197,18 @@ typedef struct {
     int flagCount;
 } fileStats;
 static string getPrefix(string name) {
-    stringstream res;
-    string str(name);
-    if (name.at(0) == '-') {
-        res << "-";
-        str = str.substr(1);
-    }
-    res << str.substr(0, str.find_first_not_of("1234567890"));
-    return res.str();
+    return DefaultScheme::isNumbered(name) ? name.substr(0, DefaultScheme::numberEnd(name)) : "";
 }
 static fileStats fileStat(string file) {
     status fileFlag(NEITHER);
-    if (file.find("+.") != string::npos) {
+    string flags(DefaultScheme::isNumbered(file) ? DefaultScheme::flags(file) : "");
+    if (flags.find('+') != string::npos) {
         fileFlag = PLUS;
-    } else if (file.find("-.") != string::npos) {
+    } else if (!flags.empty()) {
         fileFlag = MINUS;
     }
     string filePrefix(getPrefix(file));
-    int fileFlagCount((fileFlag == NEITHER) ? 0 : count(file.begin(), file.end(), (fileFlag == PLUS) ? '+' : '-'));
+    int fileFlagCount((fileFlag == NEITHER) ? 0 : count(flags.begin(), flags.end(), (fileFlag == PLUS) ? '+' : '-'));
     fileStats stats{file, fileFlag, filePrefix, fileFlagCount};
     return stats;
 }
@@ -248,10 +260,10 @@ void RenameApplication::parse() {
                     increment(group.end - 1, isPlus);
                 }
                 for (int i = group.start; i < group.end; i++) {
-                    // remove flags before incrementing; assume that the flags
-                    // are contiguous and single period in name
-                    string sansFlags(files[i].substr(0, files[i].find_last_of("1234567890") + 1)
-                            + files[i].substr(files[i].find_last_of(".")));
+                    // remove flags before incrementing
+                    size_t numberEnd(DefaultScheme::numberEnd(files[i]));
+                    string sansFlags(files[i].substr(0, numberEnd)
+                            + files[i].substr(numberEnd + DefaultScheme::flags(files[i]).size()));
                     dir_rename(files[i], sansFlags);
                 }
                 listdir();
@@ -277,26 +289,35 @@ void RenameApplication::increment(int i, bool isPlus) {
     shift_gui(shift);
 }
 
-/* Sets the range determined by the user input */
+/* Sets the range determined by the user input. Holding ctrl while clicking
+ * after a range is selected starts another range, added to the selection. */
 void RenameApplication::set_range(int index) {
+    if (first_index == SELECTED && ctrl_pressed) {
+        first_index = FIRST_UNSELECTED;
+    } else if (first_index == SELECTED) {
+        return;
+    }
     if (first_index == FIRST_UNSELECTED) {
+        if (!ctrl_pressed) {
+            selection = RangeSet();
+        }
         first_index = index;
         fileContainers[index]->setStyleClass("files firstinrange");
+        WApplication::instance()->doJavaScript(WApplication::instance()->javaScriptClass() + ".addHover()");
         WApplication::instance()->doJavaScript("document.body.style.setProperty(\"--hover-color\", \"red\")");
         return;
-    } else if (first_index == SELECTED) {
-        return;
     }
-    range = Range(first_index, index+1);
+    Range range(first_index, index+1);
     if (index < first_index) {
         range = Range(index, first_index+1);
     }
+    selection.add(range);
     first_index = SELECTED;
     WApplication::instance()->doJavaScript(WApplication::instance()->javaScriptClass() + ".deleteHover()");
 
     for (size_t i = 0; i < files.size(); i++) {
         fileContainers[i]->setStyleClass("files");
-        if (!range.OutOfRange(i)) {
+        if (selection.Contains(i)) {
             fileContainers[i]->addStyleClass("selected");
         }
     }
@@ -313,6 +334,7 @@ void RenameApplication::select_all(WKeyEvent w) {
     }
     if (a_pressed && ctrl_pressed) {
         first_index = FIRST_UNSELECTED;
+        selection = RangeSet();
         set_range(0);
         set_range(files.size() - 1);
     }
@@ -331,13 +353,18 @@ void RenameApplication::add_controls() {
 
     WContainerWidget * shiftContainer = new WContainerWidget(controls);
     WContainerWidget * insertContainer = new WContainerWidget(controls);
+    WContainerWidget * compactContainer = new WContainerWidget(controls);
     shiftContainer->setStyleClass("initial");
     insertContainer->setStyleClass("initial");
+    compactContainer->setStyleClass("initial");
+    controlContainers = {shiftContainer, insertContainer, compactContainer};
 
     WPushButton * shift = new WPushButton("Shift");
     WPushButton * insert = new WPushButton("Insert");
+    WPushButton * compact = new WPushButton("Compact");
     shift->setStyleClass("controlbutton");
     insert->setStyleClass("controlbutton");
+    compact->setStyleClass("controlbutton");
 
     WText * shift_text = new WText("Shift selection by this amount: ");
     shift_input = new WLineEdit();
@@ -363,10 +390,21 @@ void RenameApplication::add_controls() {
                 this, insert_input, insert_int));
     insert_button->setStyleClass("rightaligned");
 
+    WText * compact_text = new WText("Renumber selection without gaps, starting at (blank keeps the first number): ");
+    compact_input = new WLineEdit();
+    compact_input->setValidator(new WIntValidator());
+    compact_input->setStyleClass("rightaligned");
+    WPushButton * compact_button = new WPushButton("Compact");
+    compact_button->clicked().connect(std::bind(&RenameApplication::compact_gui,
+                this, compact_input));
+    compact_button->setStyleClass("rightaligned");
+
     shift->clicked().connect(std::bind(&RenameApplication::select_control, this,
-                shiftContainer, insertContainer));
+                shiftContainer));
     insert->clicked().connect(std::bind(&RenameApplication::select_control,
-                this, insertContainer, shiftContainer));
+                this, insertContainer));
+    compact->clicked().connect(std::bind(&RenameApplication::select_control,
+                this, compactContainer));
 
     shiftContainer->addWidget(shift);
     shiftContainer->addWidget(shift_text);
@@ -376,17 +414,23 @@ void RenameApplication::add_controls() {
     insertContainer->addWidget(insert_text);
     insertContainer->addWidget(insert_button);
     insertContainer->addWidget(insert_input);
+    compactContainer->addWidget(compact);
+    compactContainer->addWidget(compact_text);
+    compactContainer->addWidget(compact_button);
+    compactContainer->addWidget(compact_input);
 }
 
-/* Sets the other button to disabled mode */
-void RenameApplication::select_control(WContainerWidget * selected,
-        WContainerWidget * disabled) {
-    selected->setStyleClass("");
-    disabled->setStyleClass("disabled");
+/* Sets the other buttons to disabled mode */
+void RenameApplication::select_control(WContainerWidget * selected) {
+    for (size_t i = 0; i < controlContainers.size(); i++) {
+        controlContainers[i]->setStyleClass((controlContainers[i] == selected) ? "" : "disabled");
+    }
     shift_input->removeStyleClass("error");
     insert_input->removeStyleClass("error");
+    compact_input->removeStyleClass("error");
     shift_input->setText("");
     insert_input->setText("");
+    compact_input->setText("");
 }
 
 /* Shift range by the amount inputted */
@@ -397,11 +441,15 @@ void RenameApplication::shift_gui(WLineEdit * shift_in) {
     text_stream >> shift_amount;
 
     Range filesIndex(0, files.size());
-    if (!check_shift(range, shift_amount)) {  // not shifting all, but causes a conflict
+    if (selection.OutOfRange(filesIndex)) {
+        alert("Selection is out of range");
+        return;
+    }
+    if (!check_shift(selection, shift_amount)) {  // not shifting all, but causes a conflict
         shift_in->addStyleClass("error");
         alert("File collision illegal");
     } else {
-        shiftnames(range, shift_amount);
+        shiftnames(selection, shift_amount);
         alert("Done!");
         retrieve_files();
     }
@@ -421,11 +469,58 @@ void RenameApplication::insert_gui(WLineEdit * insert_in,
     text_stream << insert_in->text();
     text_stream >> index;
     Range filesIndex(0, files.size());
-    if (!range.OutOfRange(index)) {
+    if (selection.OutOfRange(filesIndex)) {
+        alert("Selection is out of range");
+        return;
+    }
+    if (selection.Contains(index)) {
         insert_in->addStyleClass("error");
         alert("Cannot insert file into the same range");
     } else {
-        insert(range, index);
+        insert(selection, index);
+        alert("Done!");
+        retrieve_files();
+    }
+}
+
+/* Toggles building changes in a staging directory and swapping it in */
+void RenameApplication::staging_changed(WCheckBox * box) {
+    setStaging(box->isChecked());
+}
+
+/* Toggles reusing listings of unchanged directories from the cache */
+void RenameApplication::cache_changed(WCheckBox * box) {
+    setCache(box->isChecked());
+}
+
+/* Toggles listing files that share a number as one entry, and redisplays
+ * the directory if one is shown */
+void RenameApplication::bundles_changed(WCheckBox * box) {
+    setBundles(box->isChecked());
+    if (!directory->text().empty()) {
+        retrieve_files();
+    }
+}
+
+/* Compact the selection, starting at the number inputted */
+void RenameApplication::compact_gui(WLineEdit * compact_in) {
+    Range filesIndex(0, files.size());
+    if (selection.OutOfRange(filesIndex)) {
+        alert("Selection is out of range");
+        return;
+    }
+    int start(first_number(selection));
+    stringstream text_stream;
+    text_stream << compact_in->text();
+    if (!text_stream.str().empty() && !(text_stream >> start)) {
+        compact_in->addStyleClass("error");
+        alert("Start must be a number");
+        return;
+    }
+    if (!compact(selection, start, 1)) {
+        compact_in->addStyleClass("error");
+        alert("File collision illegal");
+    } else {
         alert("Done!");
         retrieve_files();
     }
@@ -437,6 +532,7 @@ void RenameApplication::alert(string message) {
     root()->doJavaScript(func.str());
 }
 
+#ifndef GUI_BENCH
 /*
  * You could read information from the environment to decide whether
  * the user has permission to start a new application
@@ -449,3 +545,4 @@ WApplication *createApplication(const WEnvironment& env) {
 int main(int argc, char **argv) {
     return WRun(argc, argv, &createApplication);
 }
+#endif
@@ -0,0 +1,59 @@
+#ifndef GUI_MASS_EDIT_H
+#define GUI_MASS_EDIT_H
+
+#include <Wt/WApplication>
+#include <Wt/WCheckBox>
+#include <Wt/WContainerWidget>
+#include <Wt/WEnvironment>
+#include <Wt/WIntValidator>
+#include <Wt/WLineEdit>
+#include <Wt/WPushButton>
+
+#include <string>
+#include <vector>
+
+#include "mass_edit.h"
+
+/*
+ * GUI interface for the rename application, allowing users to mass edit
+ * numbered files with ease.
+ */
+class RenameApplication : public Wt::WApplication, public BaseRenamer {
+    public:
+        RenameApplication(const Wt::WEnvironment& env);
+        Wt::WContainerWidget * response;
+        Wt::WContainerWidget * tableContainer;
+        Wt::WContainerWidget * controls;
+
+    private:
+        friend class GuiBench;  // drives the handlers in gui_bench.cpp
+        Wt::WLineEdit * directory;
+        Wt::WLineEdit * shift_input;
+        Wt::WLineEdit * insert_input;
+        Wt::WLineEdit * compact_input;
+        std::vector<Wt::WContainerWidget *> controlContainers;
+        std::vector<Wt::WPushButton *> fileContainers;
+        int first_index;
+        RangeSet selection;
+        bool a_pressed, ctrl_pressed;
+        void retrieve_files();
+        void rebase();
+        void display_files();
+        void normalizeOp();
+        void parse();
+        void increment(int i, bool isPlus);
+        void set_range(int index);
+        void select_all(Wt::WKeyEvent w);
+        void key_up(Wt::WKeyEvent w);
+        void add_controls();
+        void select_control(Wt::WContainerWidget * selected);
+        void shift_gui(Wt::WLineEdit * input);
+        void insert_gui(Wt::WLineEdit * input, Wt::WIntValidator * intv);
+        void compact_gui(Wt::WLineEdit * input);
+        void staging_changed(Wt::WCheckBox * box);
+        void cache_changed(Wt::WCheckBox * box);
+        void bundles_changed(Wt::WCheckBox * box);
+        void alert(std::string message);
+};
+
+#endif
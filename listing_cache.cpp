@@ -0,0 +1,168 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "boost/filesystem.hpp"
+
+#include "listing_cache.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+/* Timestamps at least this many seconds older than a scan can be trusted to
+ * change with the next change to the directory, even on filesystems that
+ * only keep whole or even seconds */
+static const time_t racyWindow = 2;
+
+/* Layout of a cache file: header, then count+1 name offsets into the blob,
+ * then the blob of concatenated names. */
+static const char cacheMagic[8] = {'M', 'E', 'L', 'I', 'S', 'T', '0', '1'};
+struct CacheHeader {
+    char magic[8];
+    DirectoryKey key;
+    uint64_t count;
+    uint64_t longestName;
+    uint64_t needNormalize;
+    uint64_t blobSize;
+};
+
+/********** ListingCache class **********/
+/* Constructor */
+ListingCache::ListingCache(const string & cachedir)
+    : location(cachedir)
+{}
+
+/* $XDG_CACHE_HOME/mass_edit, or ~/.cache/mass_edit */
+string ListingCache::defaultLocation() {
+    const char * xdg = getenv("XDG_CACHE_HOME");
+    if (xdg != NULL && xdg[0] != '\0') {
+        return (fs::path(xdg) / "mass_edit").string();
+    }
+    const char * home = getenv("HOME");
+    return (fs::path((home != NULL) ? home : "/tmp") / ".cache" / "mass_edit").string();
+}
+
+/* Stat the directory. Returns false if it can't be read. */
+bool ListingCache::identify(const string & dir, DirectoryKey & key) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return false;
+    }
+    memset(&key, 0, sizeof(key));
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.mtimeSec = st.st_mtim.tv_sec;
+    key.mtimeNsec = st.st_mtim.tv_nsec;
+    key.ctimeSec = st.st_ctim.tv_sec;
+    key.ctimeNsec = st.st_ctim.tv_nsec;
+    return true;
+}
+
+/* Whether a listing scanned from started on can be stored. If the directory
+ * changed during the scan the listing may be missing the change; if it last
+ * changed within racyWindow of the scan, a change right after the scan can
+ * land in the same timestamp and leave the key matching a stale listing. */
+bool ListingCache::settled(const string & dir, const DirectoryKey & key, time_t started) {
+    DirectoryKey after;
+    return identify(dir, after)
+        && memcmp(&after, &key, sizeof(key)) == 0
+        && key.mtimeSec + racyWindow <= started;
+}
+
+/* Cache file for a directory */
+string ListingCache::path(const DirectoryKey & key) {
+    stringstream name;
+    name << hex << key.dev << "-" << key.ino << ".listing";
+    return (fs::path(location) / name.str()).string();
+}
+
+/* Load the listing stored for key. Returns false if there is no cache file,
+ * it is damaged, or it was written for another state of the directory. */
+bool ListingCache::load(const DirectoryKey & key, CachedListing & listing) {
+    int fd = open(path(key).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size(st.st_size);
+    void * map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    const char * data = (const char *) map;
+    CacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    size_t tableSize = (header.count + 1) * sizeof(uint64_t);
+    bool valid = memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) == 0
+        && memcmp(&header.key, &key, sizeof(key)) == 0
+        && header.count < size / sizeof(uint64_t)
+        && sizeof(header) + tableSize + header.blobSize == size;
+    if (valid) {
+        const uint64_t * offsets = (const uint64_t *) (data + sizeof(header));
+        const char * blob = data + sizeof(header) + tableSize;
+        listing.files.clear();
+        listing.files.reserve(header.count);
+        for (size_t i = 0; valid && i < header.count; i++) {
+            valid = offsets[i] <= offsets[i+1] && offsets[i+1] <= header.blobSize;
+            if (valid) {
+                listing.files.push_back(string(blob + offsets[i], offsets[i+1] - offsets[i]));
+            }
+        }
+        listing.longestName = header.longestName;
+        listing.needNormalize = header.needNormalize != 0;
+    }
+    munmap(map, size);
+    return valid;
+}
+
+/* Store the listing scanned from the directory identified by key. The file is
+ * written to a unique temporary beside its final name and renamed over it, so
+ * readers never see a partial file, even with several renamers storing at
+ * once. Failures only cost the next lookup a rescan. */
+void ListingCache::store(const DirectoryKey & key, const CachedListing & listing) {
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.key = key;
+    header.count = listing.files.size();
+    header.longestName = listing.longestName;
+    header.needNormalize = listing.needNormalize;
+    vector<uint64_t> offsets(1, 0);
+    for (size_t i = 0; i < listing.files.size(); i++) {
+        offsets.push_back(offsets.back() + listing.files[i].size());
+    }
+    header.blobSize = offsets.back();
+
+    string target(path(key));
+    string temp(target + ".XXXXXX");
+    boost::system::error_code ec;
+    fs::create_directories(location, ec);
+    int fd = mkstemp(&temp[0]);
+    if (fd < 0) {
+        return;
+    }
+    FILE * out = fdopen(fd, "wb");
+    if (out == NULL) {
+        close(fd);
+        remove(temp.c_str());
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+        && fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), out) == offsets.size();
+    for (size_t i = 0; ok && i < listing.files.size(); i++) {
+        ok = fwrite(listing.files[i].data(), 1, listing.files[i].size(), out)
+            == listing.files[i].size();
+    }
+    if (fclose(out) != 0 || !ok || rename(temp.c_str(), target.c_str()) != 0) {
+        remove(temp.c_str());
+    }
+}
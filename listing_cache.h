@@ -0,0 +1,52 @@
+#ifndef LISTING_CACHE_H
+#define LISTING_CACHE_H
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+/* Identity of a directory's contents: device and inode say which directory it
+ * is, mtime and ctime change whenever an entry is added, removed or renamed. */
+struct DirectoryKey {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    int64_t ctimeSec;
+    int64_t ctimeNsec;
+};
+
+/* A sorted listing along with what listdir worked out while scanning it */
+struct CachedListing {
+    std::vector<std::string> files;
+    size_t longestName;
+    bool needNormalize;
+};
+
+/* Persistent cache of sorted directory listings. Each directory gets one
+ * binary file named after its device and inode, holding a header with the
+ * full DirectoryKey, a table of name offsets and the names themselves. Files
+ * are read through mmap and only trusted when the key still matches. */
+class ListingCache {
+    public:
+        /* Constructor, keeping cache files in cachedir */
+        ListingCache(const std::string & cachedir);
+        /* $XDG_CACHE_HOME/mass_edit, or ~/.cache/mass_edit */
+        static std::string defaultLocation();
+        /* Stat the directory. Returns false if it can't be read. */
+        static bool identify(const std::string & dir, DirectoryKey & key);
+        /* Whether a listing of dir, keyed key and scanned from time started
+         * on, can be stored: the key must still match after the scan, and be
+         * old enough that a later change couldn't leave it as it is */
+        static bool settled(const std::string & dir, const DirectoryKey & key, time_t started);
+        /* Load the listing stored for key. Returns false on a miss. */
+        bool load(const DirectoryKey & key, CachedListing & listing);
+        /* Store the listing scanned from the directory identified by key */
+        void store(const DirectoryKey & key, const CachedListing & listing);
+    private:
+        std::string location;
+        std::string path(const DirectoryKey & key);
+};
+
+#endif
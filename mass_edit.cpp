@@ -1,6 +1,31 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "boost/filesystem.hpp"
+
+#include "cost_model.h"
+#include "listing_cache.h"
 #include "mass_edit.h"
+#include "rename_manifest.h"
 
 using namespace std;
+namespace fs = boost::filesystem;
 
 /********** Range class **********/
 /* Constructor */
@@ -76,50 +101,506 @@ ostream & operator<< (ostream & os, Range r) {
     return os;
 }
 
-/* Convenience utils declarations */
-static size_t numbersLen(string name);
-static size_t findSuffix(string name);
+/********** RangeSet class **********/
+/* Constructors */
+RangeSet::RangeSet() {}
 
-/********** BaseRenamer class **********/
-/* Constructor */
-BaseRenamer::BaseRenamer()
-    : files(0),
+RangeSet::RangeSet(Range r) {
+    add(r);
+}
+
+/* Constructor with string, e.g. num1-num2,num3,num4-num5 */
+RangeSet::RangeSet(string s) {
+    if (!IsRangeSet(s)) {
+        throw logic_error("Not a valid string");
+    }
+    stringstream sm(s);
+    string item;
+    while (getline(sm, item, ',')) {
+        if (Range::IsRange(item)) {
+            add(Range(item));
+        } else {
+            int n(stoi(item));
+            add(Range(n, n+1));
+        }
+    }
+}
+
+/* Static function, determines if the string is a comma separated list of
+ * ranges and indices that can be used in a constructor */
+bool RangeSet::IsRangeSet(string s) {
+    stringstream sm(s);
+    string item;
+    bool any(false);
+    while (getline(sm, item, ',')) {
+        stringstream itemstrm(item);
+        int n;
+        if (!Range::IsRange(item) && !((itemstrm >> n) && itemstrm.eof())) {
+            return false;
+        }
+        any = true;
+    }
+    return any && s.back() != ',';
+}
+
+/* Adds a range, keeping the set sorted and merged */
+void RangeSet::add(Range r) {
+    if (r.begin() > r.end()) {  // store reversed ranges ascending
+        r = Range(r.end() + 1, r.begin() + 1);
+    }
+    if (r.Span() == 0) {
+        return;
+    }
+    spans.push_back(r);
+    sort(spans.begin(), spans.end(), [](Range a, Range b) { return a.begin() < b.begin(); });
+    vector<Range> merged;
+    for (size_t i = 0; i < spans.size(); i++) {
+        if (!merged.empty() && spans[i].begin() <= merged.back().end()) {
+            merged.back() = Range(merged.back().begin(), max(merged.back().end(), spans[i].end()));
+        } else {
+            merged.push_back(spans[i]);
+        }
+    }
+    spans = merged;
+}
+
+/* Returns true if n is in one of the ranges */
+bool RangeSet::Contains(int n) {
+    for (size_t i = 0; i < spans.size(); i++) {
+        if (!spans[i].OutOfRange(n)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Returns true if any of the ranges is not entirely within bounds */
+bool RangeSet::OutOfRange(Range bounds) {
+    for (size_t i = 0; i < spans.size(); i++) {
+        if (bounds.OutOfRange(spans[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Return the number of indices in the set */
+int RangeSet::Span() {
+    int span(0);
+    for (size_t i = 0; i < spans.size(); i++) {
+        span += spans[i].Span();
+    }
+    return span;
+}
+
+/* Getters */
+bool RangeSet::empty() { return spans.empty(); }
+vector<Range> & RangeSet::ranges() { return spans; }
+
+/* Operator overload for cout */
+ostream & operator<< (ostream & os, RangeSet r) {
+    for (size_t i = 0; i < r.ranges().size(); i++) {
+        os << ((i == 0) ? "" : ",") << r.ranges()[i];
+    }
+    return os;
+}
+
+/********** BasicRenamer class **********/
+/* Options and working state, kept here so the class layout doesn't change
+ * as features are added */
+template <class Scheme>
+struct BasicRenamer<Scheme>::Impl {
+    Impl()
+        : useStaging(false),
+          bucketSize(0),
+          useBundles(false),
+          useView(false),
+          useShared(false),
+          choice(),
+          listedEntries(0)
+    {}
+    /* If plans are published through a staging directory swap */
+    bool useStaging;
+    /* Listing cache, if enabled */
+    unique_ptr<ListingCache> cache;
+    /* Files per bucket subdirectory, 0 if flat */
+    size_t bucketSize;
+    /* If same-stem files are listed as one entry */
+    bool useBundles;
+    /* Bundle stem -> the rest of each of its files' names, e.g.
+     * "03" -> {".pdf", ".txt"} */
+    map<string, vector<string>> bundles;
+    /* If operations work on the view instead of the directory */
+    bool useView;
+    /* Name in the view -> path of the file it names */
+    map<string, string> view;
+    /* Paces dir_rename and records its latency */
+    RenameThrottle throttle;
+    /* If listings are shared through the DirectoryRegistry */
+    bool useShared;
+    /* Shared version of the listing in use, keeping it alive */
+    shared_ptr<const DirectorySnapshot> snapshot;
+    /* Cost model, if the planner is on */
+    unique_ptr<CostModel> costs;
+    /* What the planner did with the last plan */
+    StrategyChoice choice;
+    /* Entries in the directory as of the last listdir */
+    size_t listedEntries;
+};
+
+/* Constructor, working on the current directory */
+template <class Scheme>
+BasicRenamer<Scheme>::BasicRenamer()
+    : dirpath(fs::current_path().string()),
+      files(),
       longestName(0),
-      needNormalize(false)
+      needNormalize(false),
+      impl(new Impl())
 {
     listdir();
 }
 
-/* Rename files with the appropriate directory prefix */
-void BaseRenamer::dir_rename(string old, string n) {
-    fs::rename(fs::current_path() / old, fs::current_path() / n);
+/* Constructor, working on the given directory */
+template <class Scheme>
+BasicRenamer<Scheme>::BasicRenamer(const string & dir)
+    : dirpath(fs::absolute(dir).string()),
+      files(),
+      longestName(0),
+      needNormalize(false),
+      impl(new Impl())
+{
+    listdir();
+}
+
+template <class Scheme>
+BasicRenamer<Scheme>::~BasicRenamer() {
+    DirectoryRegistry::instance().unsubscribe(this);
+}
+
+/* Switch to another directory and list it. Throws fs::filesystem_error if the
+ * directory can't be read. */
+template <class Scheme>
+void BasicRenamer<Scheme>::setDirectory(const string & dir) {
+    string previous(dirpath);
+    dirpath = fs::absolute(dir).string();
+    impl->useView = false;
+    impl->view.clear();
+    try {
+        listdir();
+    } catch (fs::filesystem_error &) {
+        dirpath = previous;
+        throw;
+    }
+}
+
+/* Getters */
+template <class Scheme>
+const string & BasicRenamer<Scheme>::directory() const { return dirpath; }
+template <class Scheme>
+const vector<string> & BasicRenamer<Scheme>::listing() const { return files.names(); }
+
+/* Rename files with the appropriate directory prefix. A bundle's files are
+ * all renamed, and the bundle is filed under its new stem. */
+template <class Scheme>
+void BasicRenamer<Scheme>::dir_rename(string old, string n) {
+    map<string, vector<string>>::iterator bundle = impl->bundles.find(old);
+    if (bundle == impl->bundles.end()) {
+        rename_file(old, n);
+        return;
+    }
+    vector<string> rests(move(bundle->second));
+    impl->bundles.erase(bundle);
+    for (size_t i = 0; i < rests.size(); i++) {
+        rename_file(old + rests[i], n + rests[i]);
+    }
+    impl->bundles[n] = move(rests);
+}
+
+/* Rename one file, at the pace set by the throttle. In view mode only the
+ * view's name for the file changes. */
+template <class Scheme>
+void BasicRenamer<Scheme>::rename_file(const string & old, const string & n) {
+    if (impl->useView) {
+        map<string, string>::iterator entry = impl->view.find(old);
+        if (entry == impl->view.end()) {
+            throw fs::filesystem_error("Not in the view", old,
+                    boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory));
+        }
+        string source(entry->second);
+        impl->view.erase(entry);
+        impl->view[n] = source;
+        return;
+    }
+    paced([&]() {
+        fs::path target(locate(n));
+        if (impl->bucketSize > 0 && !fs::exists(target.parent_path())) {
+            fs::create_directory(target.parent_path());
+        }
+        fs::rename(locate(old), target);
+    });
+}
+
+/* Run one filesystem step at the pace set by the throttle, recording how
+ * long it took */
+template <class Scheme>
+void BasicRenamer<Scheme>::paced(function<void()> step) {
+    impl->throttle.acquire();
+    chrono::steady_clock::time_point start(chrono::steady_clock::now());
+    step();
+    impl->throttle.record(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+}
+
+/* Lists the items in the directory. With sharing on, a version of the
+ * listing another renamer published is reused if the directory hasn't changed
+ * since; with the listing cache on, the cache is tried next. Only then is the
+ * directory rescanned and resorted, and the result published for others.
+ * In view mode the names come from the view instead. */
+template <class Scheme>
+const vector<string> & BasicRenamer<Scheme>::listdir() {
+    // the cache and registry key on the top directory, which doesn't change
+    // when files move between buckets or names change in a view
+    bool keyed(impl->bucketSize == 0 && !impl->useView);
+    if (impl->useShared && keyed) {
+        shared_ptr<const DirectorySnapshot> current(
+                DirectoryRegistry::instance().current(dirpath, Scheme::name()));
+        if (current) {
+            impl->snapshot = current;
+            files = current->files;
+            longestName = current->longestName;
+            needNormalize = needNormalize || current->needNormalize;
+            impl->listedEntries = files.size();
+            group_bundles();
+            return files.names();
+        }
+    }
+    // key is taken before the scan; the listing is only stored, and a
+    // published snapshot only reused, if the key is unchanged after it and
+    // old enough to be trusted (see settled)
+    DirectoryKey key;
+    CachedListing cached;
+    bool identified(keyed && ListingCache::identify(dirpath, key));
+    time_t scanned(time(NULL));
+    if (impl->cache && identified && impl->cache->load(key, cached)) {
+        longestName = cached.longestName;
+    } else {
+        longestName = 0;
+        int firstLongest(0);
+        bool foundLonger(false);
+        if (impl->useView) {
+            for (map<string, string>::iterator it = impl->view.begin(); it != impl->view.end(); it++) {
+                cached.files.push_back(it->first);
+            }
+        } else if (impl->bucketSize > 0) {
+            scan_buckets(cached.files);
+        } else {
+            fs::directory_iterator enditr;
+            for (fs::directory_iterator diritr(dirpath);
+                    diritr != enditr;
+                    diritr++) {
+                cached.files.push_back(diritr->path().filename().string());
+            }
+        }
+        for (size_t i = 0; i < cached.files.size(); i++) {
+            const string & s(cached.files[i]);
+            if (Scheme::isNumbered(s) && Scheme::width(s) > longestName) {
+                if (firstLongest == 0) {
+                    firstLongest = Scheme::width(s);
+                } else {
+                    foundLonger = true;
+                }
+                longestName = Scheme::width(s);
+            }
+        }
+        sort(cached.files.begin(), cached.files.end(), Scheme::compare);
+        cached.longestName = longestName;
+        cached.needNormalize = foundLonger;
+        if (impl->cache && identified && ListingCache::settled(dirpath, key, scanned)) {
+            impl->cache->store(key, cached);
+        }
+    }
+    needNormalize = needNormalize || cached.needNormalize;
+    files = NameList(move(cached.files));
+    if (impl->useShared && identified) {
+        impl->snapshot = DirectoryRegistry::instance().publish(dirpath, Scheme::name(),
+                key, scanned, files, longestName, cached.needNormalize, this);
+    }
+    impl->listedEntries = files.size();
+    group_bundles();
+    return files.names();
+}
+
+/* In bundle mode, replace the numbered names in the listing with their
+ * stems (number and flags), each listed once where its first file was. */
+template <class Scheme>
+void BasicRenamer<Scheme>::group_bundles() {
+    impl->bundles.clear();
+    if (!impl->useBundles) {
+        return;
+    }
+    vector<string> entries;
+    for (size_t i = 0; i < files.size(); i++) {
+        const string & name(files[i]);
+        if (!Scheme::isNumbered(name)) {
+            entries.push_back(name);
+            continue;
+        }
+        size_t stemEnd(Scheme::numberEnd(name) + Scheme::flags(name).size());
+        string stem(name.substr(0, stemEnd));
+        vector<string> & rests(impl->bundles[stem]);
+        if (rests.empty()) {
+            entries.push_back(stem);
+        }
+        rests.push_back(name.substr(stemEnd));
+    }
+    files = NameList(move(entries));
+}
+
+/* Group same-stem files into one entry, and relist */
+template <class Scheme>
+void BasicRenamer<Scheme>::setBundles(bool enabled) {
+    impl->useBundles = enabled;
+    listdir();
+}
+
+/* Full names of the files an entry of the listing stands for */
+template <class Scheme>
+vector<string> BasicRenamer<Scheme>::members(const string & entry) const {
+    map<string, vector<string>>::const_iterator bundle = impl->bundles.find(entry);
+    if (bundle == impl->bundles.end()) {
+        return vector<string>(1, entry);
+    }
+    vector<string> names;
+    for (size_t i = 0; i < bundle->second.size(); i++) {
+        names.push_back(entry + bundle->second[i]);
+    }
+    return names;
 }
 
-/* Lists the items in the directory */
-vector<string> & BaseRenamer::listdir() {
-    longestName = 0;
-    int firstLongest(0);
-    if (files.size() != 0) {
-        files = vector<string>(0);
+/* A plan on bundle stems as a plan on the files themselves */
+template <class Scheme>
+RenamePlan BasicRenamer<Scheme>::expand(const RenamePlan & plan) const {
+    if (impl->bundles.empty()) {
+        return plan;
+    }
+    RenamePlan expanded;
+    for (size_t i = 0; i < plan.size(); i++) {
+        vector<string> names(members(plan[i].first));
+        for (size_t j = 0; j < names.size(); j++) {
+            expanded.push_back(make_pair(names[j],
+                        plan[i].second + names[j].substr(plan[i].first.size())));
+        }
     }
+    return expanded;
+}
+
+/* Lists a bucketed directory: files at the top level (unnumbered or
+ * negative ones) plus the contents of every bucket subdirectory. Buckets are
+ * scanned by a few threads at once, each taking every n-th bucket. */
+template <class Scheme>
+void BasicRenamer<Scheme>::scan_buckets(vector<string> & names) {
+    vector<fs::path> buckets;
     fs::directory_iterator enditr;
-    for (fs::directory_iterator diritr(fs::current_path());
-            diritr != enditr;
-            diritr++) {
+    for (fs::directory_iterator diritr(dirpath); diritr != enditr; diritr++) {
         string s(diritr->path().filename().string());
-        size_t suffixstart = findSuffix(s);
-        if (suffixstart != string::npos && suffixstart - (s.at(0) == '-') > longestName) {
-            if (firstLongest == 0) {
-                firstLongest = suffixstart;
-            } else {
-                needNormalize = true;
+        if (fs::is_directory(diritr->status())
+                && s.find_first_not_of("1234567890") == string::npos) {
+            buckets.push_back(diritr->path());
+        } else {
+            names.push_back(s);
+        }
+    }
+    vector<vector<string>> contents(buckets.size());
+    size_t threads(min<size_t>(buckets.size(), max(1u, thread::hardware_concurrency())));
+    vector<thread> workers;
+    vector<string> errors(threads);
+    for (size_t t = 0; t < threads; t++) {
+        workers.push_back(thread([&, t]() {
+            try {
+                for (size_t b = t; b < buckets.size(); b += threads) {
+                    for (fs::directory_iterator diritr(buckets[b]); diritr != fs::directory_iterator(); diritr++) {
+                        contents[b].push_back(diritr->path().filename().string());
+                    }
+                }
+            } catch (fs::filesystem_error & e) {
+                errors[t] = e.what();
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    for (size_t t = 0; t < errors.size(); t++) {
+        if (!errors[t].empty()) {
+            cerr << "Cannot list bucket: " << errors[t] << endl;
+        }
+    }
+    for (size_t b = 0; b < contents.size(); b++) {
+        names.insert(names.end(), contents[b].begin(), contents[b].end());
+    }
+}
+
+/* Where a file with this name lives in the current layout. Numbered names
+ * go in the bucket for their number, e.g. 001/001234.txt for 1000 a bucket;
+ * anything else stays at the top level. */
+template <class Scheme>
+string BasicRenamer<Scheme>::locate(const string & name) {
+    fs::path dir(dirpath);
+    if (impl->bucketSize > 0 && Scheme::isNumbered(name) && Scheme::number(name) >= 0) {
+        stringstream bucket;
+        bucket << setfill('0') << setw(3) << Scheme::number(name) / impl->bucketSize;
+        dir /= bucket.str();
+    }
+    return (dir / name).string();
+}
+
+/* Treat the directory as split into buckets of size files, 0 for flat */
+template <class Scheme>
+void BasicRenamer<Scheme>::setBuckets(size_t size) {
+    impl->bucketSize = size;
+    listdir();
+}
+
+/* Move the files into the bucket layout for size, 0 to flatten. Each file is
+ * moved once, straight from its old location; emptied buckets are removed. */
+template <class Scheme>
+void BasicRenamer<Scheme>::rebucket(size_t size) {
+    if (impl->useView) {
+        cerr << "Cannot rebucket while working on a view." << endl;
+        return;
+    }
+    listdir();
+    vector<string> names, sources;
+    for (size_t i = 0; i < files.size(); i++) {
+        vector<string> group(members(files[i]));
+        names.insert(names.end(), group.begin(), group.end());
+    }
+    for (size_t i = 0; i < names.size(); i++) {
+        sources.push_back(locate(names[i]));
+    }
+    size_t previous(impl->bucketSize);
+    impl->bucketSize = size;
+    impl->throttle.reset();
+    for (size_t i = 0; i < names.size(); i++) {
+        fs::path target(locate(names[i]));
+        if (target.string() == sources[i] || fs::is_directory(sources[i])) {
+            continue;
+        }
+        if (size > 0 && !fs::exists(target.parent_path())) {
+            fs::create_directory(target.parent_path());
+        }
+        paced([&]() { fs::rename(sources[i], target); });
+    }
+    if (previous > 0) {
+        fs::directory_iterator enditr;
+        for (fs::directory_iterator diritr(dirpath); diritr != enditr; diritr++) {
+            string s(diritr->path().filename().string());
+            if (fs::is_directory(diritr->status()) && fs::is_empty(diritr->path())
+                    && s.find_first_not_of("1234567890") == string::npos) {
+                fs::remove(diritr->path());
             }
-            longestName = suffixstart;
         }
-        files.push_back(s);
     }
-    sort(files.begin(), files.end(), compare);
-    return files;
+    listdir();
 }
 
 static int compareExtensions(string file1, string file2) {
@@ -144,7 +625,7 @@ static int comparePrefix(string file1, string file1flag, string file2,
 }
 
 /* Sorts the vector of files to comply with +/- filename specs */
-bool compare(string file1, string file2) {
+bool DefaultScheme::compare(const string & file1, const string & file2) {
     int file1plus = count(file1.begin(), file1.end(), '+');
     int file2plus = count(file2.begin(), file2.end(), '+');
     int file1minus = count(file1.begin(), file1.end(), '-') - (file1.at(0) == '-');
@@ -161,97 +642,980 @@ bool compare(string file1, string file2) {
 }
 
 /* Normalize filename lengths up to numZeros */
-void BaseRenamer::normalize(int numZeros) {
-    for (size_t i = 0; i < files.size(); i++) {
-        dir_rename(files[i], normalize(files[i], numZeros));
-    }
+template <class Scheme>
+void BasicRenamer<Scheme>::normalize(int numZeros) {
+    run_plan(plan_normalize(numZeros));
     listdir();
     needNormalize = false;
 }
 
+/* Sorts with the default scheme, for code predating naming schemes */
+bool compare(string file1, string file2) {
+    return DefaultScheme::compare(file1, file2);
+}
+
 /* Normalize this filename lengths up to numZeros */
-string BaseRenamer::normalize(string filename, int numZeros) {
-    stringstream name;
-    string strName(filename);
-    if (strName.at(0) == '-') {
-        name << '-';
-        strName = filename.substr(1);
+template <class Scheme>
+string BasicRenamer<Scheme>::normalize(string filename, int numZeros) {
+    if (!Scheme::isNumbered(filename)) {
+        return filename;
     }
-    size_t suffixstart = strName.find_first_not_of("1234567890");
-    //suffixstart = (suffixstart == string::npos) ? strName.length() : suffixstart;
-    name << setfill('0') << setw(numZeros) << strName.substr(0, suffixstart);
-    name << strName.substr(suffixstart);
-    return name.str();
+    size_t start(Scheme::numberStart(filename));
+    stringstream digits;
+    digits << setfill('0') << setw(numZeros) << filename.substr(start, Scheme::numberEnd(filename) - start);
+    return Scheme::withDigits(filename, digits.str());
 }
 
 /* Filters the files by a regex pattern */
-vector<string> & BaseRenamer::filterfiles(regex pattern) {
-    vector<string>::iterator b = files.begin();
-    while (b != files.end()) {
-        if (!regex_match(*b, pattern)) {
-            b = files.erase(b);
-        } else {
-            b++;
+template <class Scheme>
+const vector<string> & BasicRenamer<Scheme>::filterfiles(regex pattern) {
+    vector<string> kept;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (regex_match(files[i], pattern)) {
+            kept.push_back(files[i]);
         }
     }
-    return files;
+    files = NameList(move(kept));
+    return files.names();
 }
 
 /* Insert and shift the names in the list, simultaneously renaming the files.
  * The item(s) at origpositions will be moved to newpos and everything else will
  * be shifted over.
  * Precondition: files has been populated by listdir. */
-void BaseRenamer::insert(Range origpositions, int newpos) {
-    if (!origpositions.OutOfRange(newpos)) {
+template <class Scheme>
+void BasicRenamer<Scheme>::insert(Range origpositions, int newpos) {
+    insert(RangeSet(origpositions), newpos);
+}
+
+/* Insert several ranges at once: the selected items keep their relative
+ * order and are moved together in front of the item at newpos. */
+template <class Scheme>
+void BasicRenamer<Scheme>::insert(RangeSet origpositions, int newpos) {
+    if (origpositions.Contains(newpos)) {
         cerr << "Cannot insert within a range." << endl;
         return;
     }
-    // Rename files in origpositions to temps
-    for (int i = origpositions.begin(); !origpositions.OutOfRange(i); i = origpositions.Next(i)) {
-        dir_rename(files[i], "temp" + to_string(i));
+    run_plan(plan_insert(origpositions, newpos));
+}
+
+/* Adds certain range of names by a number, normalizing all the names to the
+ * new longest length in the same pass.
+ * Precondition: the range and the amount to add don't break filenames. */
+template <class Scheme>
+void BasicRenamer<Scheme>::shiftnames(Range fileRange, int add) {
+    shiftnames(RangeSet(fileRange), add);
+}
+
+/* Shift several ranges of names by the same amount, in one rename plan */
+template <class Scheme>
+void BasicRenamer<Scheme>::shiftnames(RangeSet fileRanges, int add) {
+    run_plan(plan_shift(fileRanges, add));
+    listdir();
+    needNormalize = false;
+}
+
+/* Renumber the files in the ranges densely from start, step apart, in one
+ * rename pass. Files sharing a number (e.g. 03.txt, 03.pdf and 03+.txt) keep
+ * sharing their new number, and the rest of each name is kept. */
+template <class Scheme>
+bool BasicRenamer<Scheme>::compact(RangeSet fileRanges, int start, int step) {
+    RenamePlan plan(plan_compact(fileRanges, start, step));
+    if (!check_plan(plan)) {
+        return false;
+    }
+    run_plan(plan);
+    listdir();
+    return true;
+}
+
+/* Plan for normalizing all numbered names to numZeros digits */
+template <class Scheme>
+RenamePlan BasicRenamer<Scheme>::plan_normalize(int numZeros) {
+    RenamePlan plan;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (Scheme::isNumbered(files[i])) {
+            plan.push_back(make_pair(files[i], normalize(files[i], numZeros)));
+        }
     }
-    int offset;
-    if (origpositions.end() <= newpos) {
-        offset = newpos - origpositions.end();
-        for (int i = origpositions.end(); i < newpos; i++) {
-            // Rename files[i+span] to files[i]
-            dir_rename(files[i], files[i-origpositions.Span()]);
+    return plan;
+}
+
+/* Plan for moving the files at origpositions to newpos */
+template <class Scheme>
+RenamePlan BasicRenamer<Scheme>::plan_insert(Range origpositions, int newpos) {
+    return plan_insert(RangeSet(origpositions), newpos);
+}
+
+/* Plan for moving the files in origpositions in front of the file at newpos.
+ * The names stay where they are and the files are shuffled between them. */
+template <class Scheme>
+RenamePlan BasicRenamer<Scheme>::plan_insert(RangeSet origpositions, int newpos) {
+    vector<int> order;  // original index of the file that ends up at each index
+    int count(files.size());
+    for (int i = 0; i <= count; i++) {
+        if (i == newpos) {
+            for (size_t r = 0; r < origpositions.ranges().size(); r++) {
+                Range range(origpositions.ranges()[r]);
+                for (int j = range.begin(); j < range.end(); j++) {
+                    order.push_back(j);
+                }
+            }
+        }
+        if (i < count && !origpositions.Contains(i)) {
+            order.push_back(i);
+        }
+    }
+    RenamePlan plan;
+    for (size_t i = 0; i < order.size(); i++) {
+        if (order[i] != (int) i) {
+            plan.push_back(make_pair(files[order[i]], files[i]));
+        }
+    }
+    return plan;
+}
+
+/* Plan for adding add to the numbers in fileRange, with every numbered name
+ * normalized to the resulting longest length */
+template <class Scheme>
+RenamePlan BasicRenamer<Scheme>::plan_shift(Range fileRange, int add) {
+    return plan_shift(RangeSet(fileRange), add);
+}
+
+/* The ranges pick the files to shift out of the current listing; the
+ * directory is then relisted in full, since a filter may hide files that
+ * still need normalizing to the new length to keep their place. */
+template <class Scheme>
+RenamePlan BasicRenamer<Scheme>::plan_shift(RangeSet fileRanges, int add) {
+    set<string> selected;
+    for (size_t r = 0; r < fileRanges.ranges().size(); r++) {
+        Range range(fileRanges.ranges()[r]);
+        for (int i = range.begin(); i < range.end(); i++) {
+            selected.insert(files[i]);
+        }
+    }
+    listdir();
+    vector<string> shifted(files.names());
+    for (size_t i = 0; i < shifted.size(); i++) {
+        if (selected.count(files[i]) != 0) {
+            shifted[i] = addAmt(files[i], add);
+        }
+    }
+    size_t width(0);
+    for (size_t i = 0; i < shifted.size(); i++) {
+        if (Scheme::isNumbered(shifted[i])) {
+            width = max(width, Scheme::width(shifted[i]));
+        }
+    }
+    RenamePlan plan;
+    for (size_t i = 0; i < shifted.size(); i++) {
+        if (Scheme::isNumbered(shifted[i])) {
+            plan.push_back(make_pair(files[i], normalize(shifted[i], width)));
+        }
+    }
+    return plan;
+}
+
+/* Plan for compacting the ranges. The ranges pick the numbers to compact out
+ * of the current listing; the directory is then relisted in full, so every
+ * file sharing one of those numbers (03+.txt, 7-.txt hidden by a filter) is
+ * renumbered with it. Numbers are given out in compare() order. Names outside
+ * the ranges only change if the new numbers need more digits than the
+ * directory has so far; files whose name doesn't change are left out of the
+ * plan. */
+template <class Scheme>
+RenamePlan BasicRenamer<Scheme>::plan_compact(RangeSet fileRanges, int start, int step) {
+    set<int> selected;
+    for (size_t r = 0; r < fileRanges.ranges().size(); r++) {
+        Range range(fileRanges.ranges()[r]);
+        for (int i = range.begin(); i < range.end(); i++) {
+            if (Scheme::isNumbered(files[i])) {
+                selected.insert(Scheme::number(files[i]));
+            }
+        }
+    }
+    listdir();
+    vector<string> renamed(files.names());
+    size_t width(0);
+    for (size_t i = 0; i < files.size(); i++) {
+        if (Scheme::isNumbered(files[i])) {
+            width = max(width, Scheme::width(files[i]));
+        }
+    }
+    map<int, int> numbering;    // old number -> new number
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!Scheme::isNumbered(files[i])) {
+            continue;
+        }
+        int number(Scheme::number(files[i]));
+        if (selected.count(number) == 0) {
+            continue;
+        }
+        if (numbering.count(number) == 0) {
+            int next(start + (int) numbering.size() * step);
+            numbering[number] = next;
         }
+        renamed[i] = addAmt(files[i], numbering[number] - number);
+    }
+    size_t newWidth(width);
+    for (size_t i = 0; i < renamed.size(); i++) {
+        if (Scheme::isNumbered(renamed[i])) {
+            newWidth = max(newWidth, Scheme::width(renamed[i]));
+        }
+    }
+    RenamePlan plan;
+    for (size_t i = 0; i < renamed.size(); i++) {
+        if (Scheme::isNumbered(renamed[i]) && (renamed[i] != files[i] || newWidth > width)) {
+            string target(normalize(renamed[i], newWidth));
+            if (target != files[i]) {
+                plan.push_back(make_pair(files[i], target));
+            }
+        }
+    }
+    return plan;
+}
+
+/* Number of the first numbered file in the ranges, or 0 if none */
+template <class Scheme>
+int BasicRenamer<Scheme>::first_number(RangeSet fileRanges) {
+    for (size_t r = 0; r < fileRanges.ranges().size(); r++) {
+        Range range(fileRanges.ranges()[r]);
+        for (int i = range.begin(); i < range.end(); i++) {
+            if (Scheme::isNumbered(files[i])) {
+                return Scheme::number(files[i]);
+            }
+        }
+    }
+    return 0;
+}
+
+/* Checks that a plan's new names are distinct and don't overwrite files that
+ * aren't being renamed themselves. The directory is checked rather than the
+ * listing, which a filter may have narrowed. Return true if the plan is safe. */
+template <class Scheme>
+bool BasicRenamer<Scheme>::check_plan(const RenamePlan & plan) {
+    RenamePlan renames(expand(plan));
+    set<string> sources, targets;
+    for (size_t i = 0; i < renames.size(); i++) {
+        sources.insert(renames[i].first);
+    }
+    for (size_t i = 0; i < renames.size(); i++) {
+        const string & target(renames[i].second);
+        if (!targets.insert(target).second) {
+            return false;
+        }
+        if (sources.count(target) == 0
+                && (impl->useView ? impl->view.count(target) != 0 : fs::exists(fs::symlink_status(locate(target))))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Work on a view of the directory: operations rename the files in the view
+ * only, starting from the names they have now. Turning it off drops the
+ * view and goes back to the files on disk. */
+template <class Scheme>
+void BasicRenamer<Scheme>::setView(bool enabled) {
+    if (enabled && !impl->useView) {
+        listdir();
+        impl->view.clear();
+        for (size_t i = 0; i < files.size(); i++) {
+            vector<string> group(members(files[i]));
+            for (size_t j = 0; j < group.size(); j++) {
+                impl->view[group[j]] = locate(group[j]);
+            }
+        }
+    } else if (!enabled) {
+        impl->view.clear();
+    }
+    impl->useView = enabled;
+    listdir();
+}
+
+/* Make target hold the view (or, without one, the directory as it is),
+ * with each name a hard link to its file, or a symlink when target is on
+ * another filesystem. Entries already pointing at the right file are kept,
+ * so after further edits only the names that changed are relinked, and
+ * the rest unlinked, all paced by the throttle. The target is marked as a
+ * view, and won't be used unless it is empty or already marked; anything in
+ * it that isn't a file or a link is left alone and refused. */
+template <class Scheme>
+bool BasicRenamer<Scheme>::materialize(const string & target) {
+    map<string, string> wanted(impl->view);
+    if (!impl->useView) {
+        for (size_t i = 0; i < files.size(); i++) {
+            vector<string> group(members(files[i]));
+            for (size_t j = 0; j < group.size(); j++) {
+                wanted[group[j]] = locate(group[j]);
+            }
+        }
+    }
+    const string markerName(".mass_edit_view");
+    fs::path dir(fs::absolute(target));
+    try {
+        if (!fs::exists(dir)) {
+            fs::create_directories(dir);
+        } else if (fs::equivalent(dir, dirpath)) {
+            cerr << "A view can't replace the directory it is of." << endl;
+            return false;
+        } else if (!fs::is_empty(dir) && !fs::exists(dir / markerName)) {
+            cerr << target << " isn't empty, and isn't a view." << endl;
+            return false;
+        }
+        ofstream((dir / markerName).string()) << dirpath << endl;
+        struct stat sourceStat, targetStat;
+        bool linkable(stat(dirpath.c_str(), &sourceStat) == 0
+                && stat(dir.c_str(), &targetStat) == 0
+                && sourceStat.st_dev == targetStat.st_dev);
+        vector<fs::path> stale;
+        fs::directory_iterator enditr;
+        for (fs::directory_iterator diritr(dir); diritr != enditr; diritr++) {
+            string name(diritr->path().filename().string());
+            map<string, string>::iterator want = wanted.find(name);
+            boost::system::error_code ec;
+            fs::file_status st(diritr->symlink_status());
+            if (name == markerName) {
+                continue;
+            } else if (!fs::is_regular_file(st) && !fs::is_symlink(st)) {
+                cerr << "Cannot materialize view: " << diritr->path().string()
+                     << " is not a file." << endl;
+                return false;
+            } else if (want != wanted.end() && fs::equivalent(diritr->path(), want->second, ec)) {
+                wanted.erase(want);
+            } else {
+                stale.push_back(diritr->path());
+            }
+        }
+        impl->throttle.reset();
+        for (size_t i = 0; i < stale.size(); i++) {
+            paced([&]() { fs::remove(stale[i]); });
+        }
+        for (map<string, string>::iterator it = wanted.begin(); it != wanted.end(); it++) {
+            paced([&]() {
+                boost::system::error_code ec;
+                if (linkable) {
+                    fs::create_hard_link(it->second, dir / it->first, ec);
+                }
+                if (!linkable || ec) {
+                    fs::create_symlink(it->second, dir / it->first);
+                }
+            });
+        }
+    } catch (fs::filesystem_error & e) {
+        cerr << "Cannot materialize view: " << e.what() << endl;
+        return false;
+    }
+    return true;
+}
+
+/* Apply a manifest of renames. One that fits in a chunk becomes an ordinary
+ * plan. A longer one can't be held in memory to order the renames, so it is
+ * applied in two passes over the file: every file first moves to a
+ * temporary name numbered by its place in the manifest, then from there to
+ * its new name, which is free by then. If a pass fails midway the
+ * temporaries are left in the directory. The names are file names, so
+ * bundles are set aside while applying. */
+template <class Scheme>
+bool BasicRenamer<Scheme>::apply_manifest(const string & path, size_t chunkLines) {
+    RenameManifest manifest(path, chunkLines);
+    if (!manifest.good()) {
+        cerr << "Cannot read manifest " << path << endl;
+        return false;
+    }
+    if (!manifest.check([this](const string & name) {
+                return impl->useView ? impl->view.count(name) != 0 : fs::exists(locate(name));
+            })) {
+        return false;
+    }
+    const string tempPrefix(".mass_edit_manifest");
+    fs::directory_iterator enditr;
+    for (fs::directory_iterator diritr(dirpath); diritr != enditr; diritr++) {
+        if (diritr->path().filename().string().compare(0, tempPrefix.size(), tempPrefix) == 0) {
+            cerr << "Leftover " << diritr->path().string() << " is in the way." << endl;
+            return false;
+        }
+    }
+    impl->bundles.clear();
+    manifest.rewind();
+    RenameManifest::Chunk chunk;
+    if (manifest.size() <= chunkLines) {
+        manifest.next(chunk);
+        run_plan(chunk);
     } else {
-        offset = newpos - origpositions.begin();
-        for (int i = origpositions.begin()-1; i >= newpos; i--) {
-            // Rename files[i-span] to files[i]
-            dir_rename(files[i], files[i+origpositions.Span()]);
+        impl->throttle.reset();
+        for (int pass = 0; pass < 2; pass++) {
+            size_t index(0);
+            while (manifest.next(chunk)) {
+                for (size_t i = 0; i < chunk.size(); i++, index++) {
+                    string temp(tempPrefix + to_string(index));
+                    if (chunk[i].first == chunk[i].second) {
+                        continue;
+                    } else if (pass == 0) {
+                        rename_file(chunk[i].first, temp);
+                    } else {
+                        rename_file(temp, chunk[i].second);
+                    }
+                }
+            }
+            manifest.rewind();
         }
     }
-    // Rename temp files to newpos
-    for (int i = origpositions.begin(); !origpositions.OutOfRange(i); i = origpositions.Next(i)) {
-        dir_rename("temp" + to_string(i), files[i + offset]);
+    listdir();
+    return true;
+}
+
+/* Split numbered names into groups sharing a number, keeping their order */
+template <class Scheme>
+static void group_numbers(const vector<string> & names, vector<vector<string>> & groups) {
+    for (size_t i = 0; i < names.size(); i++) {
+        if (!Scheme::isNumbered(names[i])) {
+            continue;
+        }
+        if (groups.empty() || Scheme::number(groups.back().back()) != Scheme::number(names[i])) {
+            groups.push_back(vector<string>());
+        }
+        groups.back().push_back(names[i]);
     }
 }
 
-/* Adds certain range of names by a number.
- * Precondition: the range and the amount to add don't break filenames. */
-void BaseRenamer::shiftnames(Range fileRange, int add) {
-    if ((add > 0 && fileRange.begin() < fileRange.end())
-            || (add < 0 && fileRange.begin() > fileRange.end())) {
-        fileRange = fileRange.reverse();
+/* Merge the numbered files of other into this directory. Files sharing a
+ * number stay together, as in compact, and the groups of both directories
+ * are numbered densely from this directory's first number in the merged
+ * order. The directory is relisted in full first, since a filter may hide
+ * files, and every new name is checked against what the directory will hold
+ * afterwards before anything is renamed. This directory's renames then run
+ * as a plan, and the other directory's files are moved straight to their
+ * names with renameat2, which needs both on one filesystem and never
+ * overwrites a file that turned up in the meantime. */
+template <class Scheme>
+bool BasicRenamer<Scheme>::merge(const string & other, MergeMode mode, int index) {
+    if (impl->useView) {
+        cerr << "Cannot merge into a view." << endl;
+        return false;
     }
-    for (int i = fileRange.begin(); !fileRange.OutOfRange(i); i = fileRange.Next(i)) {
-        string newFile = addAmt(files[i], add);
-        if (newFile == files[i]) {
-            break;
+    fs::path otherDir(fs::absolute(other));
+    struct stat ownStat, otherStat;
+    if (stat(dirpath.c_str(), &ownStat) != 0 || stat(otherDir.c_str(), &otherStat) != 0) {
+        perror("Cannot merge");
+        return false;
+    }
+    if (ownStat.st_dev != otherStat.st_dev) {
+        cerr << "Both directories need to be on the same filesystem to merge." << endl;
+        return false;
+    }
+    if (ownStat.st_ino == otherStat.st_ino) {
+        cerr << "Cannot merge a directory with itself." << endl;
+        return false;
+    }
+    string atName((mode == MergeAt && index >= 0 && index < (int) files.size()) ? files[index] : "");
+    listdir();
+    vector<string> ownNames;
+    for (size_t i = 0; i < files.size(); i++) {
+        vector<string> group(members(files[i]));
+        ownNames.insert(ownNames.end(), group.begin(), group.end());
+    }
+    vector<vector<string>> own, theirs;
+    group_numbers<Scheme>(ownNames, own);
+    group_numbers<Scheme>(BasicRenamer<Scheme>(otherDir.string()).listing(), theirs);
+    if (theirs.empty()) {
+        cerr << "No numbered files to merge in " << otherDir.string() << endl;
+        return false;
+    }
+
+    // merged order, as (from other, group index) pairs
+    vector<pair<bool, size_t>> order;
+    size_t at(own.size());
+    if (Scheme::isNumbered(atName)) {
+        at = 0;
+        while (at < own.size() && Scheme::number(own[at][0]) < Scheme::number(atName)) {
+            at++;
         }
-        dir_rename(files[i], newFile);
     }
+    if (mode == MergeInterleave) {
+        for (size_t i = 0; i < max(own.size(), theirs.size()); i++) {
+            if (i < own.size()) {
+                order.push_back(make_pair(false, i));
+            }
+            if (i < theirs.size()) {
+                order.push_back(make_pair(true, i));
+            }
+        }
+    } else {
+        for (size_t i = 0; i < at; i++) {
+            order.push_back(make_pair(false, i));
+        }
+        for (size_t i = 0; i < theirs.size(); i++) {
+            order.push_back(make_pair(true, i));
+        }
+        for (size_t i = at; i < own.size(); i++) {
+            order.push_back(make_pair(false, i));
+        }
+    }
+
+    long next(Scheme::number((own.empty() ? theirs : own)[0][0]));
+    RenamePlan plan, incoming;
+    size_t width(0);
+    for (size_t i = 0; i < order.size(); i++, next++) {
+        const vector<string> & group((order[i].first ? theirs : own)[order[i].second]);
+        for (size_t j = 0; j < group.size(); j++) {
+            string renamed(Scheme::withNumber(group[j], next));
+            width = max(width, max(Scheme::width(renamed), Scheme::width(group[j])));
+            (order[i].first ? incoming : plan).push_back(make_pair(group[j], renamed));
+        }
+    }
+    set<string> targets;
+    for (size_t i = 0; i < plan.size() + incoming.size(); i++) {
+        pair<string, string> & rename((i < plan.size()) ? plan[i] : incoming[i - plan.size()]);
+        rename.second = normalize(rename.second, width);
+        if (!targets.insert(rename.second).second) {
+            cerr << "More than one file would be named " << rename.second << endl;
+            return false;
+        }
+    }
+    // what stays put: the entries this directory's plan doesn't rename
+    set<string> staying(ownNames.begin(), ownNames.end());
+    for (size_t i = 0; i < plan.size(); i++) {
+        staying.erase(plan[i].first);
+    }
+    for (size_t i = 0; i < incoming.size(); i++) {
+        if (staying.count(incoming[i].second) != 0) {
+            cerr << "Cannot merge " << incoming[i].first << ": " << incoming[i].second
+                 << " is in the way." << endl;
+            return false;
+        }
+    }
+
+    // the plans name files, not bundles
+    impl->bundles.clear();
+    if (!check_plan(plan)) {
+        cerr << "Renumbering " << dirpath << " would overwrite files." << endl;
+        listdir();
+        return false;
+    }
+    run_plan(plan);
+    int otherfd(open(otherDir.c_str(), O_RDONLY | O_DIRECTORY));
+    if (otherfd < 0) {
+        perror("Cannot open directory to merge");
+        listdir();
+        return false;
+    }
+    bool merged(true);
+    for (size_t i = 0; merged && i < incoming.size(); i++) {
+        fs::path target(locate(incoming[i].second));
+        if (impl->bucketSize > 0 && !fs::exists(target.parent_path())) {
+            fs::create_directory(target.parent_path());
+        }
+        paced([&]() {
+            if (renameat2(otherfd, incoming[i].first.c_str(), AT_FDCWD, target.c_str(), RENAME_NOREPLACE) != 0) {
+                perror(("Cannot merge " + incoming[i].first).c_str());
+                merged = false;
+            }
+        });
+    }
+    close(otherfd);
     listdir();
-    normalize(longestName);
+    return merged;
+}
+
+/* Build new layouts in a staging directory and swap it in atomically */
+template <class Scheme>
+void BasicRenamer<Scheme>::setStaging(bool staging) {
+    impl->useStaging = staging;
+}
+
+/* Keep sorted listings in the on-disk listing cache */
+template <class Scheme>
+void BasicRenamer<Scheme>::setCache(bool enabled) {
+    if (enabled && !impl->cache) {
+        impl->cache.reset(new ListingCache((fs::path(ListingCache::defaultLocation()) / Scheme::name()).string()));
+    } else if (!enabled) {
+        impl->cache.reset();
+    }
+}
+
+/* Choose how to carry out each plan with a cost model, calibrated per
+ * filesystem type and kept next to the listing cache */
+template <class Scheme>
+void BasicRenamer<Scheme>::setPlanner(bool enabled) {
+    if (enabled && !impl->costs) {
+        impl->costs.reset(new CostModel((fs::path(ListingCache::defaultLocation()) / "costs").string()));
+    } else if (!enabled) {
+        impl->costs.reset();
+    }
+}
+
+/* The strategy the planner picked for the last plan */
+template <class Scheme>
+const StrategyChoice & BasicRenamer<Scheme>::last_strategy() const {
+    return impl->choice;
+}
+
+/* Pacing of renames, and statistics for the last plan */
+template <class Scheme>
+RenameThrottle & BasicRenamer<Scheme>::pacing() {
+    return impl->throttle;
+}
+
+/* Share listings with other renamers in this process */
+template <class Scheme>
+void BasicRenamer<Scheme>::setShared(bool enabled) {
+    impl->useShared = enabled;
+    if (!enabled) {
+        impl->snapshot.reset();
+        DirectoryRegistry::instance().unsubscribe(this);
+    }
+}
+
+/* Call rebase when another renamer publishes a new version of this
+ * directory. It runs on the publisher's thread. */
+template <class Scheme>
+void BasicRenamer<Scheme>::subscribe(function<void()> rebase) {
+    DirectoryRegistry::instance().subscribe(dirpath, Scheme::name(), this,
+            [rebase](unsigned long) { rebase(); });
+}
+
+/* Apply a rename plan to the directory, unless it would overwrite files
+ * (see check_plan). Return false, leaving the directory alone, if so. */
+template <class Scheme>
+bool BasicRenamer<Scheme>::execute_plan(const RenamePlan & plan) {
+    if (!check_plan(plan)) {
+        cerr << "Rename plan would overwrite files; nothing renamed." << endl;
+        return false;
+    }
+    run_plan(plan);
+    return true;
+}
+
+/* Apply a checked rename plan to the directory. With staging on, readers only ever
+ * see the old or the new layout; if the staging directory can't be built,
+ * fall back to renaming in place. In a bucketed directory, buckets the plan
+ * moved the last files out of are removed afterwards. */
+template <class Scheme>
+void BasicRenamer<Scheme>::run_plan(const RenamePlan & plan) {
+    impl->throttle.reset();
+    set<string> buckets;
+    if (impl->bucketSize > 0 && !impl->useView) {
+        RenamePlan renames(expand(plan));
+        for (size_t i = 0; i < renames.size(); i++) {
+            fs::path bucket(fs::path(locate(renames[i].first)).parent_path());
+            if (bucket != fs::path(dirpath)) {
+                buckets.insert(bucket.string());
+            }
+        }
+    }
+    if (impl->costs && !impl->useView) {
+        execute_planned(plan);
+    } else {
+        if (impl->useStaging && impl->useView) {
+            // nothing on disk changes, so there is nothing to publish
+        } else if (impl->useStaging && impl->bucketSize > 0) {
+            cerr << "Staging isn't supported for bucketed directories; renaming in place." << endl;
+        } else if (impl->useStaging) {
+            if (rename_staged(plan)) {
+                // the swap bypasses dir_rename, which keeps bundles up to date
+                if (impl->useBundles) {
+                    listdir();
+                }
+                return;
+            }
+            cerr << "Falling back to in-place renames." << endl;
+        }
+        rename_in_place(plan);
+    }
+    for (set<string>::iterator it = buckets.begin(); it != buckets.end(); it++) {
+        // rmdir only succeeds for buckets left empty
+        boost::system::error_code ec;
+        fs::remove(*it, ec);
+    }
+}
+
+/* Apply a rename plan with whichever strategy the cost model estimates to
+ * be cheapest for its shape, then teach the model how long it took. With
+ * staging on (and a flat directory) the swap is the only choice, since it is
+ * what keeps readers from seeing a half-renamed layout; otherwise it is never
+ * picked. Parallel chains need an unpaced throttle. The plan is run on file
+ * names, so bundles are relisted afterwards. */
+template <class Scheme>
+void BasicRenamer<Scheme>::execute_planned(const RenamePlan & plan) {
+    RenamePlan renames(expand(plan));
+    impl->bundles.clear();
+    bool staged(impl->useStaging && impl->bucketSize == 0);
+    if (impl->useStaging && !staged) {
+        cerr << "Staging isn't supported for bucketed directories; renaming in place." << endl;
+    }
+    if (!impl->costs->prepare(dirpath)) {
+        if (staged && rename_staged(renames)) {
+            listdir();
+            return;
+        }
+        cerr << "Renaming in place." << endl;
+        rename_in_place(renames);
+        listdir();
+        return;
+    }
+    vector<RenamePlan> sequences(order_chains(renames));
+    PlanShape shape;
+    shape.moves = 0;
+    shape.chains = sequences.size();
+    shape.cycles = 0;
+    shape.entries = impl->listedEntries;
+    for (size_t i = 0; i < sequences.size(); i++) {
+        bool cycle(sequences[i].back().first.compare(0, 15, ".mass_edit_temp") == 0);
+        shape.moves += sequences[i].size() - (cycle ? 1 : 0);
+        shape.cycles += cycle ? 1 : 0;
+    }
+    impl->choice.plan++;
+    impl->choice.shape = shape;
+    impl->choice.filesystem = impl->costs->filesystem();
+    impl->choice.chosen = staged ? StagingSwap : DirectRenames;
+    for (int s = 0; s < StrategyCount; s++) {
+        RenameStrategy strategy((RenameStrategy) s);
+        bool possible((strategy == StagingSwap) == staged
+                && (strategy != ParallelChains || (impl->throttle.getRate() == 0 && sequences.size() > 1)));
+        impl->choice.estimates[s] = possible ? impl->costs->estimate(strategy, shape) : -1;
+        if (possible && impl->choice.estimates[s] < impl->choice.estimates[impl->choice.chosen]) {
+            impl->choice.chosen = strategy;
+        }
+    }
+    impl->choice.failed = false;
+    chrono::steady_clock::time_point start(chrono::steady_clock::now());
+    if (impl->choice.chosen == StagingSwap && !rename_staged(renames)) {
+        cerr << "Falling back to in-place renames." << endl;
+        impl->choice.chosen = DirectRenames;
+    }
+    if (impl->choice.chosen == ParallelChains) {
+        impl->choice.failed = !rename_parallel(sequences);
+    } else if (impl->choice.chosen == DirectRenames) {
+        for (size_t i = 0; i < sequences.size(); i++) {
+            for (size_t j = 0; j < sequences[i].size(); j++) {
+                dir_rename(sequences[i][j].first, sequences[i][j].second);
+            }
+        }
+    }
+    impl->choice.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (impl->choice.failed) {
+        // a partial run says nothing about what the whole plan costs
+        cerr << "Parallel renames failed partway; some files keep their old names." << endl;
+        listdir();
+        return;
+    }
+    impl->costs->learn(impl->choice.chosen, shape, impl->choice.seconds);
+    if (impl->useBundles) {
+        listdir();
+    }
+}
+
+/* Apply a rename plan with in-place renames, one sequence after another */
+template <class Scheme>
+void BasicRenamer<Scheme>::rename_in_place(const RenamePlan & plan) {
+    vector<RenamePlan> sequences(order_chains(plan));
+    for (size_t i = 0; i < sequences.size(); i++) {
+        for (size_t j = 0; j < sequences[i].size(); j++) {
+            dir_rename(sequences[i][j].first, sequences[i][j].second);
+        }
+    }
+}
+
+/* Order a plan into sequences that are safe to run. Moves whose target is
+ * free come first, each one freeing the name the next move in its chain
+ * wants; whatever is left forms cycles, which are broken with a temporary
+ * name. The sequences touch disjoint names, so they can also run side by
+ * side. */
+template <class Scheme>
+vector<RenamePlan> BasicRenamer<Scheme>::order_chains(const RenamePlan & plan) {
+    map<string, string> moves;      // old name -> new name, still to do
+    map<string, string> waiting;    // new name -> old name, still to do
+    for (size_t i = 0; i < plan.size(); i++) {
+        if (plan[i].first != plan[i].second) {
+            moves[plan[i].first] = plan[i].second;
+            waiting[plan[i].second] = plan[i].first;
+        }
+    }
+    vector<string> heads;
+    for (map<string, string>::iterator it = moves.begin(); it != moves.end(); it++) {
+        if (moves.count(it->second) == 0) {
+            heads.push_back(it->first);
+        }
+    }
+    vector<RenamePlan> sequences;
+    for (size_t i = 0; i < heads.size(); i++) {
+        RenamePlan chain;
+        string freed(heads[i]);
+        map<string, string>::iterator move;
+        while ((move = moves.find(freed)) != moves.end()) {
+            chain.push_back(*move);
+            waiting.erase(move->second);
+            moves.erase(move);
+            map<string, string>::iterator next = waiting.find(freed);
+            if (next == waiting.end()) {
+                break;
+            }
+            freed = next->second;
+        }
+        sequences.push_back(chain);
+    }
+    int tempCount(0);
+    while (!moves.empty()) {
+        RenamePlan cycle;
+        string start(moves.begin()->first);
+        string target(moves.begin()->second);
+        string temp;
+        do {
+            temp = ".mass_edit_temp" + to_string(tempCount++);
+        } while (fs::exists(locate(temp)));
+        cycle.push_back(make_pair(start, temp));
+        moves.erase(start);
+        waiting.erase(target);
+        // Walk back around the cycle until the move into the temp's target
+        string freed(start);
+        map<string, string>::iterator next;
+        while ((next = waiting.find(freed)) != waiting.end()) {
+            string old(next->second);
+            cycle.push_back(make_pair(old, freed));
+            moves.erase(old);
+            waiting.erase(next);
+            freed = old;
+        }
+        cycle.push_back(make_pair(temp, target));
+        sequences.push_back(cycle);
+    }
+    return sequences;
+}
+
+/* Run the sequences on several threads, each taking every n-th one. The
+ * throttle isn't shared between threads, so this is only used unpaced.
+ * Returns false if any rename failed. */
+template <class Scheme>
+bool BasicRenamer<Scheme>::rename_parallel(const vector<RenamePlan> & sequences) {
+    size_t threads(min<size_t>(sequences.size(), max(1u, thread::hardware_concurrency())));
+    vector<thread> workers;
+    vector<string> errors(threads);
+    for (size_t t = 0; t < threads; t++) {
+        workers.push_back(thread([&, t]() {
+            for (size_t i = t; i < sequences.size() && errors[t].empty(); i += threads) {
+                for (size_t j = 0; j < sequences[i].size(); j++) {
+                    fs::path target(locate(sequences[i][j].second));
+                    boost::system::error_code ec;
+                    if (impl->bucketSize > 0) {
+                        fs::create_directories(target.parent_path(), ec);
+                    }
+                    fs::rename(locate(sequences[i][j].first), target, ec);
+                    if (ec) {
+                        errors[t] = sequences[i][j].first + ": " + ec.message();
+                        break;
+                    }
+                }
+            }
+        }));
+    }
+    bool renamed(true);
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+        if (!errors[t].empty()) {
+            cerr << "Cannot rename " << errors[t] << endl;
+            renamed = false;
+        }
+    }
+    return renamed;
+}
+
+/* Apply a rename plan by hardlinking every entry of the directory into a
+ * sibling staging directory under its new name, then exchanging the two
+ * directories with one renameat2(RENAME_EXCHANGE). Nothing is copied, and the
+ * empty staging directory means the renames can't collide with each other.
+ * Returns false (leaving the directory untouched) if any step fails. */
+template <class Scheme>
+bool BasicRenamer<Scheme>::rename_staged(const RenamePlan & plan) {
+    fs::path dir(dirpath);
+    fs::path staging(dir.parent_path() / ("." + dir.filename().string() + ".staging"));
+    RenamePlan expanded(expand(plan));
+    map<string, string> targets(expanded.begin(), expanded.end());
+    map<string, string> staged;
+    if (fs::exists(staging)) {
+        cerr << "Staging directory " << staging.string() << " already exists." << endl;
+        return false;
+    }
+    try {
+        fs::create_directory(staging);
+        fs::permissions(staging, fs::status(dir).permissions());
+        fs::directory_iterator enditr;
+        for (fs::directory_iterator diritr(dir); diritr != enditr; diritr++) {
+            fs::file_status st(diritr->symlink_status());
+            string name(diritr->path().filename().string());
+            if (!fs::is_regular_file(st) && !fs::is_symlink(st)) {
+                cerr << "Cannot stage " << name << ": not a regular file." << endl;
+                fs::remove_all(staging);
+                return false;
+            }
+            map<string, string>::iterator target = targets.find(name);
+            string linked((target == targets.end()) ? name : target->second);
+            paced([&]() { fs::create_hard_link(diritr->path(), staging / linked); });
+            staged[name] = linked;
+        }
+    } catch (fs::filesystem_error & e) {
+        cerr << "Cannot build staging directory: " << e.what() << endl;
+        fs::remove_all(staging);
+        return false;
+    }
+    bool inDir(fs::equivalent(fs::current_path(), dir));
+    if (renameat2(AT_FDCWD, dir.c_str(), AT_FDCWD, staging.c_str(), RENAME_EXCHANGE) != 0) {
+        perror("Cannot swap staging directory");
+        fs::remove_all(staging);
+        return false;
+    }
+    // A working directory inside moved along with the old inode; step back
+    // into the new one before clearing out the old layout.
+    if (inDir) {
+        fs::current_path(dir);
+    }
+    clear_staged(staging.string(), staged);
+    return true;
+}
+
+/* Empty the old directory left behind by a staging swap. Entries that were
+ * linked into the new directory are unlinked; anything created or replaced
+ * since they were linked is moved over under its own name, so writers
+ * working during the swap lose nothing. The old directory is kept, with a
+ * message, if something can't be moved without overwriting. */
+template <class Scheme>
+void BasicRenamer<Scheme>::clear_staged(const string & old,
+        const map<string, string> & staged) {
+    fs::path dir(dirpath);
+    bool kept(false);
+    vector<fs::path> entries;
+    fs::directory_iterator enditr;
+    for (fs::directory_iterator diritr(old); diritr != enditr; diritr++) {
+        entries.push_back(diritr->path());
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        string name(entries[i].filename().string());
+        map<string, string>::const_iterator link = staged.find(name);
+        boost::system::error_code ec;
+        if (link != staged.end() && fs::equivalent(entries[i], dir / link->second, ec)) {
+            fs::remove(entries[i], ec);
+        } else if (renameat2(AT_FDCWD, entries[i].c_str(), AT_FDCWD, (dir / name).c_str(),
+                    RENAME_NOREPLACE) != 0) {
+            cerr << "Cannot move " << name << ", created during the swap: " << strerror(errno) << endl;
+            kept = true;
+        }
+    }
+    if (kept) {
+        cerr << "Leaving the old layout in " << old << endl;
+        return;
+    }
+    boost::system::error_code ec;
+    fs::remove(old, ec);
+    if (ec) {
+        cerr << "Cannot remove " << old << ": " << ec.message() << endl;
+    }
 }
 
 /* Checks if a file collisions will happen due to a shift. Return true if no
  * file collisions, false if there are.
  * Preconditions: fileRange is listed from lowest to largest */
-bool BaseRenamer::check_shift(Range fileRange, int shift) {
+template <class Scheme>
+bool BasicRenamer<Scheme>::check_shift(Range fileRange, int shift) {
     Range allFiles = Range(0, files.size());
     if (fileRange.Span() == allFiles.Span() // Same range, no file collisions
             || (shift > 0 && fileRange.end() == allFiles.end())
@@ -283,35 +1647,49 @@ bool BaseRenamer::check_shift(Range fileRange, int shift) {
     return true;
 }
 
-/* Convenience utils */
-static size_t numbersLen(string name) {
-    return name.find_last_of("1234567890") - name.find_first_of("1234567890");
-}
-static size_t findSuffix(string name) {
-    return ((name.at(0) != '-') ? name : name.substr(1)).find_first_not_of("1234567890")
-        + (name.at(0) == '-');
+/* Checks if a shift of several ranges will cause file collisions, either
+ * with files outside the ranges or between the shifted files themselves.
+ * Return true if no file collisions, false if there are. */
+template <class Scheme>
+bool BasicRenamer<Scheme>::check_shift(RangeSet fileRanges, int shift) {
+    set<string> unchanged;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!fileRanges.Contains(i)) {
+            unchanged.insert(files[i]);
+        }
+    }
+    set<string> targets;
+    for (size_t r = 0; r < fileRanges.ranges().size(); r++) {
+        Range range(fileRanges.ranges()[r]);
+        for (int i = range.begin(); i < range.end(); i++) {
+            string newFile = normalize(addAmt(files[i], shift), longestName);
+            if (newFile == files[i]) {
+                cerr << "File doesn't start with number." << endl;
+                return false;
+            }
+            if (unchanged.count(newFile) != 0 || !targets.insert(newFile).second) {
+                return false;
+            }
+        }
+    }
+    return true;
 }
 
 /* Add (or subtract) the given amount from the filename */
-string BaseRenamer::addAmt(string filename, int amt) {
-    int fileNum;
-    stringstream strm(filename);
-    size_t suffixstart = findSuffix(filename);
-    if (strm >> fileNum) {
-        stringstream newFile("");
-        fileNum += amt;
-        newFile << fileNum;
-        if (numbersLen(newFile.str()) > longestName) {
-            longestName = numbersLen(newFile.str());
-        }
-        string suffix = "";
-        if (suffixstart != string::npos) {
-            suffix = filename.substr(suffixstart);
-            newFile << suffix;
-        }
-        return newFile.str();
-    } else {
+template <class Scheme>
+string BasicRenamer<Scheme>::addAmt(string filename, int amt) {
+    if (!Scheme::isNumbered(filename)) {
         cerr << "File doesn't start with number." << endl;
+        return filename;
     }
-    return filename;
+    long fileNum(Scheme::number(filename) + amt);
+    if (fileNum < 0 && !Scheme::negative) {
+        cerr << "File number can't be negative." << endl;
+        return filename;
+    }
+    return Scheme::withNumber(filename, fileNum);
 }
+
+template class BasicRenamer<DefaultScheme>;
+template class BasicRenamer<ScanScheme>;
+template class BasicRenamer<CameraScheme>;
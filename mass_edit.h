@@ -1,25 +1,30 @@
-#include <algorithm>
-#include <cmath>
-#include <cstdio>
-#include <exception>
-#include <iomanip>
-#include <iostream>
+#ifndef MASS_EDIT_H
+#define MASS_EDIT_H
+
+/* Public interface of the mass edit engine (libmassedit). This header only
+ * pulls in the standard library, and doesn't open any namespaces, so it can be
+ * included from other programs linking against libmassedit. */
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <ostream>
 #include <regex>
-#include <set>
-#include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
-#include "boost/filesystem.hpp"
 
-using namespace std;
-namespace fs = boost::filesystem;
+#include "cost_model.h"
+#include "directory_model.h"
+#include "naming_scheme.h"
+#include "rename_throttle.h"
 
 /* Used for indicating a range of numbers. The range is [l, u). (end-exclusive) */
 class Range {
     public:
         Range(int begin, int end);
-        Range(string s);
-        static bool IsRange(string s);
+        Range(std::string s);
+        static bool IsRange(std::string s);
         bool OutOfRange(int n);
         bool OutOfRange(Range r);
         int Next(int n);
@@ -32,51 +37,193 @@ class Range {
         int start;
         int last;
 };
-ostream & operator<< (ostream & os, Range r);
+std::ostream & operator<< (std::ostream & os, Range r);
 
-class BaseRenamer {
+/* A set of ranges, e.g. 1-3,7-9,12 (a single index n is n-n+1). The ranges are
+ * kept ascending, sorted and merged, so each index is in at most one of them. */
+class RangeSet {
     public:
-        /* Constructor */
-        BaseRenamer();
-        /* Rename files with the appropriate directory prefix */
-        void dir_rename(string old, string n);
+        RangeSet();
+        RangeSet(Range r);
+        RangeSet(std::string s);
+        static bool IsRangeSet(std::string s);
+        void add(Range r);
+        bool Contains(int n);
+        bool OutOfRange(Range bounds);  // true if any range isn't within bounds
+        int Span();     // number of indices in the set
+        bool empty();
+        std::vector<Range> & ranges();
+    private:
+        std::vector<Range> spans;
+};
+std::ostream & operator<< (std::ostream & os, RangeSet r);
+
+/* Where merge puts the other directory's files: after this directory's,
+ * alternating with them, or in front of the file at an index */
+enum MergeMode { MergeAppend, MergeInterleave, MergeAt };
+
+/* A set of renames to apply together, as (old name, new name) pairs. Order
+ * does not matter; the executor works out a collision-free ordering. */
+typedef std::vector<std::pair<std::string, std::string>> RenamePlan;
+
+/* The renamer, parsing and ordering names with a NamingScheme (see
+ * naming_scheme.h). It is compiled in mass_edit.cpp for the schemes listed at
+ * the bottom of this file; a new scheme needs adding there as well. */
+template <class Scheme>
+class BasicRenamer {
+    public:
+        /* Constructor, working on the current directory */
+        BasicRenamer();
+        /* Constructor, working on the given directory */
+        BasicRenamer(const std::string & dir);
+        virtual ~BasicRenamer();
+        /* Switch to another directory and list it */
+        void setDirectory(const std::string & dir);
+        /* The directory being worked on */
+        const std::string & directory() const;
+        /* The current listing, as of the last listdir or filterfiles */
+        const std::vector<std::string> & listing() const;
+        /* Rename files with the appropriate directory prefix. In bundle mode
+         * an entry is renamed with all of its files. */
+        void dir_rename(std::string old, std::string n);
         /* Lists the items in the directory */
-        vector<string> & listdir();
+        const std::vector<std::string> & listdir();
         /* Normalize filename lengths */
         void normalize(int numZeros);
         /* Normalize this filename lengths up to numZeros */
-        string normalize(string filename, int numZeros);
+        std::string normalize(std::string filename, int numZeros);
         /* Filters the files by a regex pattern */
-        vector<string> & filterfiles(regex pattern);
+        const std::vector<std::string> & filterfiles(std::regex pattern);
         /* Insert and shift the names in the list, simultaneously renaming the files */
         void insert(Range origpositions, int newpos);
+        void insert(RangeSet origpositions, int newpos);
         /* Adds certain range of names by a number */
         void shiftnames(Range files, int add);
+        void shiftnames(RangeSet files, int add);
+        /* Renumber the files in the ranges densely from start, step apart.
+         * Returns false, renaming nothing, if that would overwrite files. */
+        bool compact(RangeSet fileRanges, int start, int step);
+        /* Checks if a shift will cause any file collisions */
+        bool check_shift(Range fileRange, int shift);
+        bool check_shift(RangeSet fileRanges, int shift);
+        /* Plans for the operations above, without touching the directory.
+         * Shift and compact relist it in full first; their ranges index the
+         * listing as it was before. */
+        RenamePlan plan_normalize(int numZeros);
+        RenamePlan plan_insert(Range origpositions, int newpos);
+        RenamePlan plan_insert(RangeSet origpositions, int newpos);
+        RenamePlan plan_shift(Range fileRange, int add);
+        RenamePlan plan_shift(RangeSet fileRanges, int add);
+        RenamePlan plan_compact(RangeSet fileRanges, int start, int step);
+        /* Checks that a plan's new names are distinct and don't overwrite
+         * files that aren't being renamed */
+        bool check_plan(const RenamePlan & plan);
+        /* Number of the first numbered file in the ranges, or 0 if none */
+        int first_number(RangeSet fileRanges);
+        /* Apply a rename plan to the directory. Returns false, renaming
+         * nothing, if the plan fails check_plan. */
+        bool execute_plan(const RenamePlan & plan);
+        /* Apply a manifest of "old<TAB>new" lines (see rename_manifest.h),
+         * reading it chunkLines lines at a time. Returns false, leaving the
+         * directory alone, if the manifest doesn't check out. */
+        bool apply_manifest(const std::string & path, size_t chunkLines = 65536);
+        /* Move the numbered files of other into this directory, renumbering
+         * both sides densely in the order given by mode (index is for
+         * MergeAt). Each file is renamed once. Returns false if nothing
+         * could be merged. */
+        bool merge(const std::string & other, MergeMode mode, int index);
+        /* Build new layouts in a staging directory and swap it in atomically */
+        void setStaging(bool staging);
+        /* Keep sorted listings in the on-disk listing cache */
+        void setCache(bool enabled);
+        /* Pick the cheapest way to carry out each plan (see cost_model.h)
+         * instead of renaming in place */
+        void setPlanner(bool enabled);
+        /* The strategy the planner picked for the last plan, with the
+         * estimates it was picked from */
+        const StrategyChoice & last_strategy() const;
+        /* Pacing of renames, and statistics for the last plan */
+        RenameThrottle & pacing();
+        /* Treat the directory as split into subdirectories of size files by
+         * number (000/, 001/, ...), 0 for a flat directory */
+        void setBuckets(size_t size);
+        /* Move the files into the bucket layout for size (0 to flatten) */
+        void rebucket(size_t size);
+        /* Where a file with this name lives in the current layout */
+        std::string locate(const std::string & name);
+        /* Group files sharing a number and flags (03.txt, 03.pdf) into one
+         * entry of the listing, named by that stem ("03"), so operations
+         * and collision checks work on the group as a whole */
+        void setBundles(bool enabled);
+        /* Full names of the files an entry of the listing stands for */
+        std::vector<std::string> members(const std::string & entry) const;
+        /* Work on a view: operations only rename the files as the view
+         * names them, leaving the directory alone. Switching directory ends
+         * the view. */
+        void setView(bool enabled);
+        /* Link the view's names (or the directory's, without a view) into
+         * target, relinking only names whose file changed since last time */
+        bool materialize(const std::string & target);
+        /* Share listings with other renamers in this process through the
+         * DirectoryRegistry */
+        void setShared(bool enabled);
+        /* Call rebase when another renamer publishes a new version of this
+         * directory. Needs sharing on; replaces any earlier subscription. */
+        void subscribe(std::function<void()> rebase);
     protected:
+        /* Directory being worked on */
+        std::string dirpath;
         /* List of files */
-        vector<string> files;
+        NameList files;
         /* Longest file name */
         size_t longestName;
         /* If necessary to normalize files */
         bool needNormalize;
+        /* Options and working state of the features (see mass_edit.cpp),
+         * behind a pointer so adding one doesn't change this class's layout */
+        struct Impl;
+        std::unique_ptr<Impl> impl;
+        /* Names of the bucket subdirectories that exist, scanning them in
+         * parallel */
+        void scan_buckets(std::vector<std::string> & names);
+        /* Replace the listing's numbered names with their bundle stems */
+        void group_bundles();
+        /* A plan on bundle stems as a plan on the files themselves */
+        RenamePlan expand(const RenamePlan & plan) const;
+        /* Rename one file, paced by the throttle */
+        void rename_file(const std::string & old, const std::string & n);
+        /* Run one filesystem step paced by the throttle, recording its latency */
+        void paced(std::function<void()> step);
+        /* Apply a rename plan already known to be safe */
+        void run_plan(const RenamePlan & plan);
+        /* Apply a rename plan with the strategy the cost model picks */
+        void execute_planned(const RenamePlan & plan);
+        /* Order a plan into independent sequences of safe renames: chains,
+         * and cycles broken with a temporary name */
+        std::vector<RenamePlan> order_chains(const RenamePlan & plan);
+        /* Apply a rename plan with in-place renames, breaking cycles with temps */
+        void rename_in_place(const RenamePlan & plan);
+        /* Run independent sequences on several threads */
+        bool rename_parallel(const std::vector<RenamePlan> & sequences);
+        /* Apply a rename plan by hardlinking into a staging directory and
+         * exchanging it with the current one. Returns false if nothing changed. */
+        bool rename_staged(const RenamePlan & plan);
+        /* Empty and remove the old directory after a staging swap, given
+         * the names linked into the new one and what they were linked as */
+        void clear_staged(const std::string & old,
+                const std::map<std::string, std::string> & staged);
         /* Adds amt to the file name number */
-        string addAmt(string filename, int amt);
-        /* Checks if a shift will cause any file collisions */
-        bool check_shift(Range fileRange, int shift);
+        std::string addAmt(std::string filename, int amt);
 };
+
+extern template class BasicRenamer<DefaultScheme>;
+extern template class BasicRenamer<ScanScheme>;
+extern template class BasicRenamer<CameraScheme>;
+
+/* The renamer for the original naming convention */
+typedef BasicRenamer<DefaultScheme> BaseRenamer;
+
 /* Sorts the vector of files to comply with +/- filename specs */
-bool compare(string file1, string file2);
+bool compare(std::string file1, std::string file2);
 
-class CLIRenamer : public BaseRenamer {
-    public:
-        /* Constructor */
-        CLIRenamer();
-        /* CLI commands */
-        void InterpretCommands();
-        void InterpretChangeDir(stringstream & line);
-        void InterpretList(stringstream & line);
-        void InterpretShift(stringstream & line);
-        void InterpretInsert(stringstream & line);
-        void InterpretQuit();
-        void InterpretHelp(string errmessage);
-};
+#endif
@@ -0,0 +1,130 @@
+#ifndef NAMING_SCHEME_H
+#define NAMING_SCHEME_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+/* Naming schemes describe how a numbered filename is put together:
+ *
+ *     <prefix>[-]<digits><flags><rest>
+ *
+ * e.g. "05++.txt", "scan_0042.tif" or "IMG-0042-v2.jpg". A scheme is a struct
+ * deriving from NamingScheme<itself> which provides, as compile-time
+ * constants:
+ *     prefix()     literal text before the number
+ *     negative     if a '-' right before the number is a sign
+ *     flagChars()  characters that can follow the number as +/- flags
+ *     filter()     regex matching the plain numbered files, for listings
+ *     name()       short name, used to keep listing caches apart
+ * NamingScheme supplies the parsing and formatting built on those constants;
+ * since they are known when the renamer is compiled for a scheme, the checks
+ * for features a scheme doesn't have fold away. */
+template <class Rules>
+struct NamingScheme {
+    /* Index of the first digit of the number, or npos if not numbered */
+    static size_t numberStart(const std::string & name) {
+        size_t start(std::strlen(Rules::prefix()));
+        if (name.compare(0, start, Rules::prefix()) != 0) {
+            return std::string::npos;
+        }
+        if (Rules::negative && start + 1 < name.size() && name[start] == '-') {
+            start++;
+        }
+        return (start < name.size() && isdigit(name[start])) ? start : std::string::npos;
+    }
+    /* Index just past the digits of the number */
+    static size_t numberEnd(const std::string & name) {
+        size_t end(name.find_first_not_of("1234567890", numberStart(name)));
+        return (end == std::string::npos) ? name.size() : end;
+    }
+    static bool isNumbered(const std::string & name) {
+        return numberStart(name) != std::string::npos;
+    }
+    static bool isNegative(const std::string & name) {
+        size_t start(numberStart(name));
+        return Rules::negative && start != std::string::npos
+            && start == std::strlen(Rules::prefix()) + 1;
+    }
+    /* Number of digits in the number */
+    static size_t width(const std::string & name) {
+        return numberEnd(name) - numberStart(name);
+    }
+    /* Value of the number. Precondition: isNumbered(name) */
+    static long number(const std::string & name) {
+        long n(std::strtol(name.c_str() + numberStart(name), NULL, 10));
+        return isNegative(name) ? -n : n;
+    }
+    /* The flags right after the number, e.g. "++" in "05++.txt" */
+    static std::string flags(const std::string & name) {
+        size_t end(numberEnd(name));
+        size_t rest(name.find_first_not_of(Rules::flagChars(), end));
+        return name.substr(end, ((rest == std::string::npos) ? name.size() : rest) - end);
+    }
+    /* The name with the number's digits replaced, keeping sign and suffix */
+    static std::string withDigits(const std::string & name, const std::string & digits) {
+        return name.substr(0, numberStart(name)) + digits + name.substr(numberEnd(name));
+    }
+    /* The name with its number replaced by n (written without padding) */
+    static std::string withNumber(const std::string & name, long n) {
+        std::string head(Rules::prefix());
+        if (n < 0) {
+            head += '-';
+        }
+        return head + std::to_string(std::labs(n)) + name.substr(numberEnd(name));
+    }
+    /* Order by number, then flags (+ after, - before the plain number), then
+     * the rest of the name. Unnumbered names go after numbered ones. */
+    static bool compare(const std::string & file1, const std::string & file2) {
+        bool numbered1(isNumbered(file1)), numbered2(isNumbered(file2));
+        if (!numbered1 || !numbered2) {
+            return (numbered1 != numbered2) ? numbered1 : file1 < file2;
+        }
+        long n1(number(file1)), n2(number(file2));
+        if (n1 != n2) {
+            return n1 < n2;
+        }
+        std::string flags1(flags(file1)), flags2(flags(file2));
+        long weight1(std::count(flags1.begin(), flags1.end(), '+') - std::count(flags1.begin(), flags1.end(), '-'));
+        long weight2(std::count(flags2.begin(), flags2.end(), '+') - std::count(flags2.begin(), flags2.end(), '-'));
+        if (weight1 != weight2) {
+            return weight1 < weight2;
+        }
+        return file1.substr(numberEnd(file1) + flags1.size())
+            < file2.substr(numberEnd(file2) + flags2.size());
+    }
+};
+
+/* The original convention: 05.txt, 05+.txt, 6-.txt, -3.txt */
+struct DefaultScheme : NamingScheme<DefaultScheme> {
+    static constexpr const char * prefix() { return ""; }
+    static constexpr bool negative = true;
+    static constexpr const char * flagChars() { return "+-"; }
+    static constexpr const char * filter() { return "\\d+(\\.[a-zA-Z]{3})?"; }
+    static constexpr const char * name() { return "default"; }
+    /* Sorts the vector of files to comply with +/- filename specs */
+    static bool compare(const std::string & file1, const std::string & file2);
+};
+
+/* Scanner output: scan_0042.tif, scan_0042+.tif */
+struct ScanScheme : NamingScheme<ScanScheme> {
+    static constexpr const char * prefix() { return "scan_"; }
+    static constexpr bool negative = false;
+    static constexpr const char * flagChars() { return "+-"; }
+    static constexpr const char * filter() { return "scan_\\d+[+-]*(\\.[a-zA-Z]{3})?"; }
+    static constexpr const char * name() { return "scan"; }
+};
+
+/* Camera output: IMG-0042.jpg, IMG-0042-v2.jpg. The '-' after the number
+ * starts a version tag, so only '+' flags are recognized. */
+struct CameraScheme : NamingScheme<CameraScheme> {
+    static constexpr const char * prefix() { return "IMG-"; }
+    static constexpr bool negative = false;
+    static constexpr const char * flagChars() { return "+"; }
+    static constexpr const char * filter() { return "IMG-\\d+\\+*(-v\\d+)?(\\.[a-zA-Z]{3})?"; }
+    static constexpr const char * name() { return "camera"; }
+};
+
+#endif
@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include "boost/filesystem.hpp"
+
+#include "rename_manifest.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+/* Most runs read at once while merging; more are merged in several passes */
+static const size_t fanIn = 64;
+
+/********** RenameManifest class **********/
+/* Constructor, reading path chunkLines lines at a time */
+RenameManifest::RenameManifest(const string & path, size_t chunkLines)
+    : path(path),
+      chunkLines(max<size_t>(1, chunkLines)),
+      input(path),
+      lineNumber(0),
+      renames(0),
+      failed(!input),
+      runCount(0)
+{}
+
+/* Removes any sorted runs left on disk */
+RenameManifest::~RenameManifest() {
+    if (!workdir.empty()) {
+        boost::system::error_code ec;
+        fs::remove_all(workdir, ec);
+    }
+}
+
+bool RenameManifest::good() const { return !failed; }
+size_t RenameManifest::size() const { return renames; }
+
+/* Start reading from the first line again */
+void RenameManifest::rewind() {
+    input.clear();
+    input.seekg(0);
+    lineNumber = 0;
+}
+
+/* Read the next chunk of renames. Blank lines are skipped; anything else
+ * must be two plain file names separated by one tab. */
+bool RenameManifest::next(Chunk & chunk) {
+    chunk.clear();
+    string line;
+    while (!failed && chunk.size() < chunkLines && getline(input, line)) {
+        lineNumber++;
+        if (line.empty()) {
+            continue;
+        }
+        size_t tab(line.find('\t'));
+        string old(line.substr(0, tab));
+        string n((tab == string::npos) ? "" : line.substr(tab + 1));
+        if (old.empty() || n.empty() || n.find('\t') != string::npos
+                || line.find('/') != string::npos
+                || old == "." || old == ".." || n == "." || n == "..") {
+            cerr << path << ":" << lineNumber << ": expected <old name><TAB><new name>" << endl;
+            failed = true;
+            return false;
+        }
+        chunk.push_back(make_pair(old, n));
+    }
+    return !failed && !chunk.empty();
+}
+
+/* Check the whole manifest against the directory. The old and new names of
+ * each chunk go to their own sorted runs; merging the old names finds
+ * duplicates and missing files, then merging the new names alongside the
+ * merged old names finds duplicates and new names that are taken by a file
+ * staying where it is. */
+bool RenameManifest::check(function<bool(const string &)> exists) {
+    rewind();
+    renames = 0;
+    vector<string> sourceRuns, targetRuns;
+    Chunk chunk;
+    while (next(chunk)) {
+        vector<string> sources, targets;
+        for (size_t i = 0; i < chunk.size(); i++) {
+            sources.push_back(chunk[i].first);
+            targets.push_back(chunk[i].second);
+        }
+        renames += chunk.size();
+        sourceRuns.push_back(write_run(sources));
+        targetRuns.push_back(write_run(targets));
+    }
+    if (failed) {
+        return false;
+    }
+    string sorted(run_path());
+    string previous;
+    bool first(true);
+    {
+        ofstream out(sorted);
+        bool ok = merge(sourceRuns, [&](const string & name) {
+            if (!first && name == previous) {
+                cerr << name << " is renamed more than once." << endl;
+                return false;
+            }
+            if (!exists(name)) {
+                cerr << name << " doesn't exist." << endl;
+                return false;
+            }
+            out << name << '\n';
+            previous = name;
+            first = false;
+            return true;
+        });
+        if (!ok) {
+            return false;
+        }
+    }
+    ifstream in(sorted);
+    string source;
+    bool more(getline(in, source));
+    first = true;
+    return merge(targetRuns, [&](const string & name) {
+        if (!first && name == previous) {
+            cerr << "More than one file is renamed to " << name << "." << endl;
+            return false;
+        }
+        while (more && source < name) {
+            more = static_cast<bool>(getline(in, source));
+        }
+        if (!(more && source == name) && exists(name)) {
+            cerr << "Renaming to " << name << " would overwrite a file that isn't renamed." << endl;
+            return false;
+        }
+        previous = name;
+        first = false;
+        return true;
+    });
+}
+
+/* Path for a new run file in the work directory, creating it */
+string RenameManifest::run_path() {
+    if (workdir.empty()) {
+        workdir = (fs::temp_directory_path() / fs::unique_path("mass_edit_manifest-%%%%-%%%%-%%%%")).string();
+        fs::create_directory(workdir);
+    }
+    return (fs::path(workdir) / ("run" + to_string(runCount++))).string();
+}
+
+/* Sort names and write them to a new run file, one per line */
+string RenameManifest::write_run(vector<string> & names) {
+    sort(names.begin(), names.end());
+    string run(run_path());
+    ofstream out(run);
+    for (size_t i = 0; i < names.size(); i++) {
+        out << names[i] << '\n';
+    }
+    return run;
+}
+
+/* Call visit for every name of the sorted runs, in order, until it returns
+ * false. With more than fanIn runs, groups of them are first merged into
+ * longer runs. */
+bool RenameManifest::merge(vector<string> runs, Visitor visit) {
+    while (runs.size() > fanIn) {
+        vector<string> merged;
+        for (size_t i = 0; i < runs.size(); i += fanIn) {
+            vector<string> group(runs.begin() + i, runs.begin() + min(runs.size(), i + fanIn));
+            string run(run_path());
+            ofstream out(run);
+            merge_group(group, [&out](const string & name) {
+                out << name << '\n';
+                return true;
+            });
+            for (size_t j = 0; j < group.size(); j++) {
+                fs::remove(group[j]);
+            }
+            merged.push_back(run);
+        }
+        runs.swap(merged);
+    }
+    return merge_group(runs, visit);
+}
+
+/* k-way merge of the runs, keeping the head of each run in a heap */
+bool RenameManifest::merge_group(const vector<string> & runs, Visitor visit) {
+    typedef pair<string, size_t> Head;
+    vector<unique_ptr<ifstream>> streams;
+    priority_queue<Head, vector<Head>, greater<Head>> heads;
+    for (size_t i = 0; i < runs.size(); i++) {
+        streams.push_back(unique_ptr<ifstream>(new ifstream(runs[i])));
+        string name;
+        if (getline(*streams[i], name)) {
+            heads.push(make_pair(name, i));
+        }
+    }
+    while (!heads.empty()) {
+        Head head(heads.top());
+        heads.pop();
+        if (!visit(head.first)) {
+            return false;
+        }
+        if (getline(*streams[head.second], head.first)) {
+            heads.push(head);
+        }
+    }
+    return true;
+}
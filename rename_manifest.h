@@ -0,0 +1,56 @@
+#ifndef RENAME_MANIFEST_H
+#define RENAME_MANIFEST_H
+
+#include <cstddef>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* A list of renames worked out elsewhere, one "old<TAB>new" line per file.
+ * It is read a fixed number of lines at a time, so manifests larger than
+ * memory can be checked and applied. Checking sorts each chunk's names into
+ * runs on disk and merges them, which finds files renamed twice, new names
+ * used twice, and new names that would overwrite a file not being renamed. */
+class RenameManifest {
+    public:
+        typedef std::vector<std::pair<std::string, std::string>> Chunk;
+        /* Constructor, reading path chunkLines lines at a time */
+        RenameManifest(const std::string & path, size_t chunkLines);
+        /* Removes any sorted runs left on disk */
+        ~RenameManifest();
+        /* If the manifest could be opened and no line was malformed */
+        bool good() const;
+        /* Start reading from the first line again */
+        void rewind();
+        /* Read the next chunk of renames. Returns false once the manifest
+         * is used up, or at a malformed line (good() is false then). */
+        bool next(Chunk & chunk);
+        /* Number of renames, once check() has read the whole manifest */
+        size_t size() const;
+        /* Check the whole manifest against the directory; exists says if a
+         * file of that name is in it. Returns false after printing the first
+         * problem found. */
+        bool check(std::function<bool(const std::string &)> exists);
+    private:
+        typedef std::function<bool(const std::string &)> Visitor;
+        std::string path;
+        size_t chunkLines;
+        std::ifstream input;
+        size_t lineNumber;
+        size_t renames;
+        bool failed;
+        std::string workdir;
+        size_t runCount;
+        /* Path for a new run file in the work directory, creating it */
+        std::string run_path();
+        /* Sort names and write them to a new run file, returning its path */
+        std::string write_run(std::vector<std::string> & names);
+        /* Call visit for every name of the sorted runs, in order, until it
+         * returns false. Merges a bounded number of runs at a time. */
+        bool merge(std::vector<std::string> runs, Visitor visit);
+        bool merge_group(const std::vector<std::string> & runs, Visitor visit);
+};
+
+#endif
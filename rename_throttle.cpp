@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <thread>
+
+#include "rename_throttle.h"
+
+using namespace std;
+
+/* Tuning: a rename slower than slowFactor times the baseline counts as a
+ * latency spike; the rate is halved at most once per backoffInterval and
+ * never goes below minimumShare of the configured rate. */
+static const double slowFactor = 4.0;
+static const double backoffInterval = 0.1;
+static const double minimumShare = 0.05;
+static const size_t warmup = 20;
+
+/********** RenameThrottle class **********/
+/* Constructor, unlimited */
+RenameThrottle::RenameThrottle()
+    : configured(0),
+      effective(0),
+      tokens(0),
+      baseline(0),
+      backoffs(0)
+{
+    reset();
+}
+
+/* Renames per second, 0 for unlimited */
+void RenameThrottle::setRate(double perSecond) {
+    configured = max(0.0, perSecond);
+    reset();
+}
+
+double RenameThrottle::getRate() const { return configured; }
+
+/* Start a new plan: clears the statistics and any backoff */
+void RenameThrottle::reset() {
+    effective = configured;
+    tokens = 1;
+    baseline = 0;
+    backoffs = 0;
+    latencies.clear();
+    refilled = started = lastRecorded = lastBackoff = clock::now();
+}
+
+/* Wait until the next rename is allowed. The bucket holds a tenth of a
+ * second's worth of renames, so bursts stay short. */
+void RenameThrottle::acquire() {
+    if (effective <= 0) {
+        return;
+    }
+    double burst(max(1.0, effective / 10));
+    clock::time_point now(clock::now());
+    tokens = min(burst, tokens + chrono::duration<double>(now - refilled).count() * effective);
+    refilled = now;
+    if (tokens < 1) {
+        this_thread::sleep_for(chrono::duration<double>((1 - tokens) / effective));
+        refilled = clock::now();
+        tokens = 1;
+    }
+    tokens -= 1;
+}
+
+/* Record how long a rename took. The first few renames set the baseline;
+ * after that a spike halves the rate, and each normal rename moves the
+ * baseline a little and wins back 1% of the configured rate. */
+void RenameThrottle::record(double seconds) {
+    clock::time_point now(clock::now());
+    lastRecorded = now;
+    latencies.push_back(seconds);
+    if (latencies.size() <= warmup) {
+        baseline += (seconds - baseline) / latencies.size();
+        return;
+    }
+    if (seconds > slowFactor * baseline) {
+        if (configured > 0 && chrono::duration<double>(now - lastBackoff).count() > backoffInterval) {
+            effective = max(configured * minimumShare, effective / 2);
+            lastBackoff = now;
+            backoffs++;
+        }
+    } else {
+        baseline = 0.95 * baseline + 0.05 * seconds;
+        effective = min(configured, effective + configured / 100);
+    }
+}
+
+RenameThrottle::Stats RenameThrottle::stats() const {
+    Stats s;
+    s.renames = latencies.size();
+    s.seconds = chrono::duration<double>(lastRecorded - started).count();
+    s.throughput = (s.seconds > 0) ? s.renames / s.seconds : 0;
+    s.p99 = 0;
+    if (!latencies.empty()) {
+        vector<double> sorted(latencies);
+        size_t index((sorted.size() - 1) * 99 / 100);
+        nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+        s.p99 = sorted[index];
+    }
+    s.rate = effective;
+    s.backoffs = backoffs;
+    return s;
+}
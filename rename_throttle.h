@@ -0,0 +1,48 @@
+#ifndef RENAME_THROTTLE_H
+#define RENAME_THROTTLE_H
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+/* Paces renames so large plans don't swamp shared filesystems. A token bucket
+ * caps the renames per second; when a rename takes much longer than the
+ * recent baseline the rate is halved, then crept back up while renames stay
+ * fast. Latencies are recorded for reporting either way. */
+class RenameThrottle {
+    public:
+        struct Stats {
+            size_t renames;
+            double seconds;     // wall time from reset to the last rename
+            double throughput;  // renames per second
+            double p99;         // 99th percentile rename latency, in seconds
+            double rate;        // rate the bucket is running at now (0: unlimited)
+            size_t backoffs;
+        };
+        /* Constructor, unlimited */
+        RenameThrottle();
+        /* Renames per second, 0 for unlimited */
+        void setRate(double perSecond);
+        double getRate() const;
+        /* Start a new plan: clears the statistics and any backoff */
+        void reset();
+        /* Wait until the next rename is allowed */
+        void acquire();
+        /* Record how long a rename took, adapting the rate */
+        void record(double seconds);
+        Stats stats() const;
+    private:
+        typedef std::chrono::steady_clock clock;
+        double configured;
+        double effective;
+        double tokens;
+        double baseline;
+        clock::time_point refilled;
+        clock::time_point started;
+        clock::time_point lastRecorded;
+        clock::time_point lastBackoff;
+        size_t backoffs;
+        std::vector<double> latencies;
+};
+
+#endif